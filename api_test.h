@@ -0,0 +1,491 @@
+#ifndef STACK_API_TEST_H
+#define STACK_API_TEST_H
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "exception.h"
+#include "flat_combining_stack.h"
+#include "my_stack.h"
+#include "parallel_hash.h"
+#include "record_stack.h"
+#include "stack_arena.h"
+#include "stack_machine.h"
+
+/*
+ * Checks of the public interface. Unlike the crash tests, they know the expected result
+ * and report whether it was met. operator new is replaced here to count allocations,
+ * so this header belongs to one translation unit only.
+ */
+
+static std::atomic<size_t> allocation_count{0};
+
+void* operator new(size_t size) {
+  ++allocation_count;
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  ++allocation_count;
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+#define EXPECT(condition) {                                                                    \
+  if (!(condition)) {                                                                          \
+    std::cerr << "expectation failed: " #condition " (" << __FILE__ << ':' << __LINE__ << ")\n"; \
+    return false;                                                                              \
+  }                                                                                            \
+}
+
+#define EXPECT_THROW(statement, exception) {                                                   \
+  bool thrown = false;                                                                         \
+  try {                                                                                        \
+    statement;                                                                                 \
+  } catch (const exception&) {                                                                 \
+    thrown = true;                                                                             \
+  }                                                                                            \
+  EXPECT(thrown);                                                                              \
+}
+
+bool errorCodesTest() {
+  Stack<int> st;
+  EXPECT(st.tryPop() == StackError::EMPTY_STACK);
+  EXPECT(st.tryTop().error == StackError::EMPTY_STACK);
+  EXPECT(st.tryAt(0).error == StackError::OUT_OF_RANGE);
+
+  for (int i = 0; i < 10; ++i) {
+    EXPECT(st.tryPush(i) == StackError::OK);
+  }
+  EXPECT(st.tryTop().ok() && st.tryTop().value() == 9);
+  EXPECT(st.tryAt(3).ok() && st.tryAt(3).value() == 3);
+  EXPECT(st.tryAt(10).error == StackError::OUT_OF_RANGE);
+  EXPECT(st.tryPop() == StackError::OK);
+  EXPECT(st.tryTop().value() == 8);
+
+#ifndef NDEBUG
+  // corruption is reported as a code, nothing is thrown
+  int* item = const_cast<int*>(&st.tryAt(5).value());
+  *item = 17;
+  EXPECT(st.tryPush(0) == StackError::HASH_SUM);
+  EXPECT(st.tryPop() == StackError::HASH_SUM);
+  EXPECT(st.tryTop().error == StackError::HASH_SUM);
+  EXPECT(st.tryAt(0).error == StackError::HASH_SUM);
+  EXPECT_THROW(st.push(0), HashSumException);
+  *item = 5;
+
+  *(item - 5 - 1) = 0;
+  EXPECT(st.tryTop().error == StackError::CANARY);
+  *(item - 5 - 1) = 1983776228;
+  EXPECT(st.check());
+#endif
+  return true;
+}
+
+bool healthyPathAllocationTest() {
+  Stack<int> st;
+  st.push(1);
+  st.push(2);
+  st.push(3);
+
+  size_t allocations_before = allocation_count;
+  EXPECT(st.tryPush(4) == StackError::OK);
+  EXPECT(st.tryTop().value() == 4);
+  EXPECT(st.tryAt(0).value() == 1);
+  EXPECT(st.tryPop() == StackError::OK);
+  EXPECT(st.view().size() == 3);
+  EXPECT(allocation_count == allocations_before);
+  return true;
+}
+
+bool selfPushTest() {
+  Stack<std::string> st;
+  st.push("a string long enough to live on the heap");
+  // every growth happens while the pushed value is still in the old buffer
+  for (int i = 0; i < 40; ++i) {
+    st.push(st[0]);
+    EXPECT(st.tryPush(st.top()) == StackError::OK);
+  }
+  EXPECT(st.size() == 81);
+  EXPECT(st.top() == "a string long enough to live on the heap");
+  return true;
+}
+
+Word runProgram(const std::string& source) {
+  StackMachine machine;
+  return machine.run(assemble(source));
+}
+
+bool stackMachineTest() {
+  // a forward and a backward label, both patched with byte offsets
+  Bytecode code = assemble("start: JMP end\n"
+                           "       JMP start\n"
+                           "end:   PUSH 5\n");
+  Word target = 0;
+  std::memcpy(&target, code.data() + 1, sizeof(Word));
+  EXPECT(target == static_cast<Word>(2 * (1 + sizeof(Word))));
+  std::memcpy(&target, code.data() + 2 + sizeof(Word), sizeof(Word));
+  EXPECT(target == 0);
+  EXPECT(code.back() == OP_HALT);
+  EXPECT_THROW(assemble("JMP nowhere"), BytecodeException);
+  EXPECT_THROW(assemble("a: PUSH 1\na: PUSH 2"), BytecodeException);
+  EXPECT_THROW(assemble("JUMP 0"), BytecodeException);
+  EXPECT_THROW(assemble("PUSH"), BytecodeException);
+
+  // arguments are read in order, RET leaves only the result over the caller's operands
+  EXPECT(runProgram("      PUSH 100\n"
+                    "      PUSH 3\n"
+                    "      PUSH 4\n"
+                    "      CALL sub 2\n"
+                    "      ADD\n"
+                    "      HALT\n"
+                    "sub:  ARG 0\n"
+                    "      ARG 1\n"
+                    "      SUB\n"
+                    "      RET\n") == 99);
+
+  EXPECT_THROW(runProgram("PUSH 1\nPUSH 0\nDIV"), BytecodeException);
+  EXPECT_THROW(runProgram("PUSH 1\nPUSH 0\nMOD"), BytecodeException);
+  StackMachine machine;
+  EXPECT_THROW(machine.run(Bytecode{OPCODE_COUNT}), BytecodeException);
+
+  // ARG can't reach the caller's operands or the callee's temporaries
+  EXPECT_THROW(runProgram("ARG 0"), BytecodeException);
+  EXPECT_THROW(runProgram("PUSH 1\nPUSH 2\nCALL f 1\nHALT\nf: ARG -1\nRET"), BytecodeException);
+  EXPECT_THROW(runProgram("PUSH 1\nCALL f 1\nHALT\nf: PUSH 7\nARG 1\nRET"), BytecodeException);
+  return true;
+}
+
+bool arenaIdReuseTest() {
+  StackArena<int> arena;
+  StackArena<int>::Handle first = arena.create();
+  StackArena<int>::Handle second = arena.create();
+  arena.push(second, 7);
+  arena.release(first);
+
+  StackArena<int>::Handle third = arena.create();
+  EXPECT(third.id == first.id);
+  arena.push(third, 1);
+  EXPECT(arena.top(third) == 1 && arena.top(second) == 7);
+#ifndef NDEBUG
+  EXPECT_THROW(arena.push(first, 2), IncorrectPointerException);
+#endif
+
+  // the handle table doesn't grow while stacks come and go
+  arena.release(arena.create());
+  size_t memory_usage = arena.memoryUsage();
+  for (int i = 0; i < 1000; ++i) {
+    arena.release(arena.create());
+  }
+  EXPECT(arena.memoryUsage() == memory_usage);
+  EXPECT(arena.stackCount() == 2);
+  return true;
+}
+
+bool overflowTest() {
+#ifndef NDEBUG
+  Stack<int> st;
+  st.push(1);
+  // the capacity is 8, so items[8] is the sentinel and items[9..15] pad the line it shares with the items
+  int* items = const_cast<int*>(&st[0]);
+  int saved = items[8];
+  items[8] = 0;
+  items[9] = 0;
+  EXPECT(!st.check());
+  EXPECT(st.tryTop().error == StackError::CANARY);
+  items[8] = saved;
+  EXPECT(st.check());
+  // the second canary starts the next cache line
+  saved = items[16];
+  items[16] = 0;
+  EXPECT(!st.check());
+  items[16] = saved;
+  EXPECT(st.check());
+#endif
+  return true;
+}
+
+bool parallelHashTest() {
+  const size_t BASE = 15487469;
+  const size_t MODULO = 1e12 + 7;
+  WorkerPool pool(3);
+  // 4 chunks per thread, so chunks change their size at multiples of 16
+  const size_t CHUNK_COUNT = 16;
+  std::hash<int> hasher;
+
+  std::vector<int> items;
+  for (size_t count = 0; count <= 4 * CHUNK_COUNT + 1; ++count) {
+    EXPECT(calcPolynomialHashParallel(pool, items.data(), items.size(), count, hasher, BASE, MODULO)
+           == calcPolynomialHash(items.data(), items.size(), count, hasher, BASE, MODULO));
+    items.push_back(static_cast<int>(count * 7919));
+  }
+  for (size_t count : {CHUNK_COUNT * 100 - 1, CHUNK_COUNT * 100, CHUNK_COUNT * 100 + 1}) {
+    items.resize(count, -1);
+    EXPECT(calcPolynomialHashParallel(pool, items.data(), items.size(), count, hasher, BASE, MODULO)
+           == calcPolynomialHash(items.data(), items.size(), count, hasher, BASE, MODULO));
+  }
+
+  size_t allocations_before = allocation_count;
+  calcPolynomialHashParallel(pool, items.data(), items.size(), 0, hasher, BASE, MODULO);
+  EXPECT(allocation_count == allocations_before);
+  return true;
+}
+
+bool savepointTest() {
+  Stack<std::string> st;
+  st.push("bottom");
+  Stack<std::string>::Savepoint outer = st.mark();
+  for (int i = 0; i < 100; ++i) {
+    st.push("a string long enough to live on the heap #" + std::to_string(i));
+  }
+  Stack<std::string>::Savepoint inner = st.mark();
+  st.push("inner");
+  st.rollbackTo(inner);
+  EXPECT(st.size() == 101);
+  EXPECT(st.top() == "a string long enough to live on the heap #99");
+
+  Stack<std::string>::Savepoint committed = st.mark();
+  st.push("kept");
+  st.commit(committed);
+  EXPECT(st.top() == "kept");
+  EXPECT_THROW(st.rollbackTo(committed), IncorrectArgumentException);
+
+  st.rollbackTo(outer);
+  EXPECT(st.size() == 1);
+  EXPECT(st.top() == "bottom");
+  EXPECT_THROW(st.rollbackTo(outer), IncorrectArgumentException);
+
+  // a pop below a savepoint drops it
+  Stack<std::string>::Savepoint popped = st.mark();
+  st.pop();
+  EXPECT_THROW(st.rollbackTo(popped), IncorrectArgumentException);
+#ifndef NDEBUG
+  EXPECT(st.check());
+#endif
+
+  // savepoints go along with the items
+  Stack<std::string>::Savepoint moved_savepoint = st.mark();
+  Stack<std::string> moved(std::move(st));
+  moved.push("moved");
+  moved.rollbackTo(moved_savepoint);
+  EXPECT(moved.size() == 0);
+
+  // a savepoint belongs to its own stack only
+  Stack<std::string> without_savepoints;
+  EXPECT_THROW(without_savepoints.commit(moved_savepoint), IncorrectArgumentException);
+  Stack<std::string> other;
+  other.push("other");
+  Stack<std::string>::Savepoint foreign = moved.mark();
+  other.mark();
+  EXPECT_THROW(other.rollbackTo(foreign), IncorrectArgumentException);
+  EXPECT_THROW(other.commit(foreign), IncorrectArgumentException);
+  EXPECT(other.size() == 1);
+  return true;
+}
+
+bool viewTest() {
+  Stack<int> st;
+  for (int i = 0; i < 10; ++i) {
+    st.push(i);
+  }
+  Stack<int>::View view = st.view();
+  int sum = 0;
+  for (int item : view) {
+    sum += item;
+  }
+  EXPECT(sum == 45);
+  EXPECT(view.size() == 10 && view[9] == 9);
+
+#ifndef NDEBUG
+  st.push(10);
+  EXPECT_THROW(view.begin(), InvalidatedViewException);
+  EXPECT_THROW(view[0], InvalidatedViewException);
+  Stack<int>::Savepoint savepoint = st.mark();
+  view = st.view();
+  st.rollbackTo(savepoint);
+  EXPECT_THROW(view.data(), InvalidatedViewException);
+
+  Stack<int>* dead = new Stack<int>(st);
+  view = dead->view();
+  delete dead;
+  EXPECT_THROW(view.begin(), InvalidatedViewException);
+
+  // the buffer goes to the new stack, which may free it on growth
+  Stack<int> source(st);
+  view = source.view();
+  Stack<int> target(std::move(source));
+  EXPECT_THROW(view.begin(), InvalidatedViewException);
+
+  // changes inside a batch invalidate views right away
+  auto invalidated = [](const Stack<int>::View& stale) {
+    try {
+      stale.begin();
+    } catch (const InvalidatedViewException&) {
+      return true;
+    }
+    return false;
+  };
+  bool grown_invalidated = false;
+  view = target.view();
+  target.batch([&](Stack<int>::Batch& batch) {
+    for (int i = 0; i < 1000; ++i) {
+      batch.push(i);
+    }
+    grown_invalidated = invalidated(view);
+  });
+  EXPECT(grown_invalidated);
+  bool popped_invalidated = false;
+  view = target.view();
+  target.batch([&](Stack<int>::Batch& batch) {
+    batch.pop();
+    popped_invalidated = invalidated(view);
+  });
+  EXPECT(popped_invalidated);
+#endif
+  return true;
+}
+
+bool flatCombiningTest() {
+  FlatCombiningStack<int> st;
+  EXPECT_THROW(st.pop(), EmptyStackException);
+  st.push(-1);
+
+  std::vector<std::thread> threads;
+  for (int thread_id = 0; thread_id < 8; ++thread_id) {
+    threads.emplace_back([&st, thread_id]() {
+      for (int i = 0; i < 1000; ++i) {
+        st.push(thread_id);
+        st.pop();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT(st.top() == -1);
+  size_t size = 0;
+  st.locked([&size](Stack<int>& stack) {
+    size = stack.size();
+  });
+  EXPECT(size == 1);
+  return true;
+}
+
+bool recordStackTest() {
+  RecordStack records;
+  EXPECT(records.empty());
+  EXPECT_THROW(records.pop(), EmptyStackException);
+
+  records.push(42, 1);
+  records.pushString("hello", 2);
+  records.push(2.5, 3);
+  EXPECT(records.size() == 3);
+
+  EXPECT(records.topTag() == 3 && records.top<double>() == 2.5);
+  EXPECT_THROW(records.top<char>(), IncorrectArgumentException);
+  records.pop();
+  EXPECT(records.topTag() == 2 && records.topSize() == 5 && records.topString() == "hello");
+  records.pop();
+  EXPECT(records.topTag() == 1 && records.top<int>() == 42);
+  records.pop();
+  EXPECT(records.empty() && records.bytes() == 0);
+
+  std::string big(1000, 'x');
+  for (int i = 0; i < 10; ++i) {
+    records.pushString(big, static_cast<uint32_t>(i));
+  }
+  EXPECT(records.topTag() == 9 && records.topString() == big);
+
+  // duplicating the top record: the buffer grows while the payload is still in it
+  RecordStack dups;
+  dups.pushString(std::string(200, 'd'), 1);
+  for (int i = 0; i < 8; ++i) {
+    dups.pushBytes(dups.topData(), dups.topSize(), dups.topTag() + 1);
+  }
+  EXPECT(dups.size() == 9 && dups.topTag() == 9 && dups.topString() == std::string(200, 'd'));
+#ifndef NDEBUG
+  EXPECT(records.check());
+  EXPECT(dups.check());
+
+  // fields of the object are covered too: the main canary comes first, record_count_ is found by its value
+  RecordStack corrupted;
+  for (int i = 0; i < 77; ++i) {
+    corrupted.push(i);
+  }
+  uint32_t* main_canary = reinterpret_cast<uint32_t*>(&corrupted);
+  uint32_t saved_canary = *main_canary;
+  *main_canary = 0;
+  EXPECT(!corrupted.check());
+  *main_canary = saved_canary;
+  EXPECT(corrupted.check());
+
+  size_t* fields = reinterpret_cast<size_t*>(&corrupted);
+  size_t* record_count = nullptr;
+  for (size_t field_id = 0; field_id < sizeof(RecordStack) / sizeof(size_t); ++field_id) {
+    if (fields[field_id] == 77) {
+      EXPECT(record_count == nullptr);
+      record_count = fields + field_id;
+    }
+  }
+  EXPECT(record_count != nullptr);
+  ++*record_count;
+  EXPECT(!corrupted.check());
+  --*record_count;
+  EXPECT(corrupted.check());
+#endif
+  return true;
+}
+
+#define RUN_TEST(test) {                                            \
+  bool passed = test();                                             \
+  std::cerr << #test << (passed ? ": OK\n" : ": FAILED\n");         \
+  all_passed &= passed;                                             \
+}
+
+bool runApiTests() {
+  bool all_passed = true;
+  RUN_TEST(errorCodesTest);
+  RUN_TEST(healthyPathAllocationTest);
+  RUN_TEST(selfPushTest);
+  RUN_TEST(stackMachineTest);
+  RUN_TEST(arenaIdReuseTest);
+  RUN_TEST(overflowTest);
+  RUN_TEST(parallelHashTest);
+  RUN_TEST(savepointTest);
+  RUN_TEST(viewTest);
+  RUN_TEST(flatCombiningTest);
+  RUN_TEST(recordStackTest);
+  return all_passed;
+}
+
+#endif //STACK_API_TEST_H
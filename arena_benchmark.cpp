@@ -0,0 +1,69 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "my_stack.h"
+#include "stack_arena.h"
+
+/*
+ * A lot of tiny per-vertex stacks: compares bytes per stack of StackArena and of separate Stacks.
+ * The checked build of Stack logs every construction to stderr, so redirect it: ./arena_benchmark 2>/dev/null
+ */
+
+size_t degreeOf(size_t vertex) {
+  return (vertex * 2654435761u) % 7;
+}
+
+int main(int argc, char** argv) {
+  size_t vertex_count = (argc > 1 ? std::stoul(argv[1]) : 100000);
+#ifdef NDEBUG
+  const char* mode = "unchecked";
+#else
+  const char* mode = "checked";
+#endif
+
+  try {
+    auto start = std::chrono::steady_clock::now();
+    StackArena<int> arena;
+    std::vector<StackArena<int>::Handle> handles;
+    handles.reserve(vertex_count);
+    for (size_t vertex = 0; vertex < vertex_count; ++vertex) {
+      handles.push_back(arena.create());
+      for (size_t edge = 0; edge < degreeOf(vertex); ++edge) {
+        arena.push(handles.back(), static_cast<int>(edge));
+      }
+    }
+    double arena_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    size_t arena_bytes = arena.memoryUsage() + handles.capacity() * sizeof(StackArena<int>::Handle);
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<Stack<int>>> stacks;
+    stacks.reserve(vertex_count);
+    size_t stack_bytes = stacks.capacity() * sizeof(std::unique_ptr<Stack<int>>);
+    for (size_t vertex = 0; vertex < vertex_count; ++vertex) {
+      stacks.emplace_back(new Stack<int>());
+      for (size_t edge = 0; edge < degreeOf(vertex); ++edge) {
+        stacks.back()->push(static_cast<int>(edge));
+      }
+      stack_bytes += stacks.back()->memoryUsage();
+    }
+    double stack_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::printf("%-10s %zu stacks\n", mode, vertex_count);
+    std::printf("%-10s StackArena %8.1f bytes/stack %10.2f ms\n", mode,
+                static_cast<double>(arena_bytes) / vertex_count, arena_ms);
+    std::printf("%-10s Stack      %8.1f bytes/stack %10.2f ms (without malloc overhead)\n", mode,
+                static_cast<double>(stack_bytes) / vertex_count, stack_ms);
+
+    start = std::chrono::steady_clock::now();
+    arena.reset();
+    double reset_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%-10s StackArena reset %.2f ms\n", mode, reset_ms);
+  } catch (StackException& exc) {
+    std::cerr << exc;
+    return 1;
+  }
+  return 0;
+}
@@ -1,10 +1,70 @@
 #ifndef STACK_EXCEPTION_H
 #define STACK_EXCEPTION_H
 
+#include <cassert>
 #include <iostream>
 #include <exception>
+#include <new>
 #include <string>
 
+enum class StackError {
+  OK,
+  EMPTY_STACK,
+  OUT_OF_RANGE,
+  BAD_ALLOC,
+  PARAMS_POISONED,
+  INCORRECT_POINTER,
+  CANARY,
+  HASH_SUM
+};
+
+inline const char* errorMessage(StackError error) {
+  switch (error) {
+    case StackError::OK:
+      return "ok";
+    case StackError::EMPTY_STACK:
+      return "stack is empty";
+    case StackError::OUT_OF_RANGE:
+      return "the argument is more than the number of elements";
+    case StackError::BAD_ALLOC:
+      return "unable to allocate memory";
+    case StackError::PARAMS_POISONED:
+      return "parameters are corrupted";
+    case StackError::INCORRECT_POINTER:
+      return "pointers are destroyed";
+    case StackError::CANARY:
+      return "canaries were overwritten";
+    case StackError::HASH_SUM:
+      return "control hash sum doesn't match";
+  }
+  return "unknown error";
+}
+
+/*
+ * Result of the non-throwing accessors: either an error code or a pointer to the item.
+ */
+template<class T>
+struct StackResult {
+  StackError error;
+  T* item;
+
+  StackResult(StackError error, T* item = nullptr): error(error), item(item) {}
+
+  bool ok() const {
+    return error == StackError::OK;
+  }
+
+  explicit operator bool() const {
+    return ok();
+  }
+
+  // only for a result that is ok(), there is no item otherwise
+  T& value() const {
+    assert(ok());
+    return *item;
+  }
+};
+
 struct StackException : public std::exception {
   std::string message;
   std::string function_name;
@@ -48,6 +108,11 @@ struct IncorrectPointerException : public StackException {
     StackException(message, function_name) {}
 };
 
+struct InvalidatedViewException : public StackException {
+  InvalidatedViewException(const std::string& message, const std::string& function_name = ""):
+    StackException(message, function_name) {}
+};
+
 std::ostream& operator<<(std::ostream& os, const StackException& iaexception) {
   os << "!!! Exception: " << iaexception.message;
   if (!iaexception.function_name.empty()) {
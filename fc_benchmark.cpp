@@ -0,0 +1,75 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "flat_combining_stack.h"
+#include "my_stack.h"
+
+/*
+ * Contention benchmark: every thread pushes and pops in turns.
+ * The checked build of Stack logs reallocations to stderr, so redirect it: ./fc_benchmark 2>/dev/null
+ */
+
+template<class T>
+class MutexStack {
+ private:
+  Stack<T> stack_;
+  std::mutex mutex_;
+
+ public:
+  void push(const T& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stack_.push(value);
+  }
+
+  void pop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stack_.pop();
+  }
+};
+
+template<class Container>
+double measure(size_t thread_count, size_t operation_count) {
+  Container container;
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t thread_id = 0; thread_id < thread_count; ++thread_id) {
+    threads.emplace_back([&container, thread_count, operation_count]() {
+      for (size_t operation_id = 0; operation_id < operation_count / thread_count / 2; ++operation_id) {
+        container.push(static_cast<int>(operation_id));
+        container.pop();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+#ifdef NDEBUG
+  const char* mode = "unchecked";
+  size_t operation_count = (argc > 1 ? std::stoul(argv[1]) : 1000000);
+#else
+  const char* mode = "checked";
+  size_t operation_count = (argc > 1 ? std::stoul(argv[1]) : 100000);
+#endif
+
+  try {
+    std::printf("%-10s %zu operations\n", mode, operation_count);
+    std::printf("%-10s %8s %16s %16s\n", mode, "threads", "mutex, ms", "combining, ms");
+    for (size_t thread_count = 1; thread_count <= 64; thread_count *= 2) {
+      double mutex_ms = measure<MutexStack<int>>(thread_count, operation_count);
+      double combining_ms = measure<FlatCombiningStack<int>>(thread_count, operation_count);
+      std::printf("%-10s %8zu %16.2f %16.2f\n", mode, thread_count, mutex_ms, combining_ms);
+    }
+  } catch (StackException& exc) {
+    std::cerr << exc;
+    return 1;
+  }
+  return 0;
+}
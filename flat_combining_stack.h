@@ -0,0 +1,271 @@
+#ifndef STACK_FLAT_COMBINING_STACK_H
+#define STACK_FLAT_COMBINING_STACK_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "exception.h"
+#include "memory_layout.h"
+#include "my_stack.h"
+
+/*
+ * Small numbers for live threads: a number is given on the first call in a thread
+ * and becomes free again when the thread exits.
+ */
+class ThreadIds {
+ private:
+  struct Registry {
+    std::mutex mutex;
+    std::vector<size_t> free_ids;
+    size_t next_id{0};
+  };
+
+  struct Holder {
+    size_t id;
+
+    Holder() {
+      Registry& registry = getRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      if (registry.free_ids.empty()) {
+        id = registry.next_id++;
+      } else {
+        id = registry.free_ids.back();
+        registry.free_ids.pop_back();
+      }
+    }
+
+    ~Holder() {
+      Registry& registry = getRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.free_ids.push_back(id);
+    }
+  };
+
+  static Registry& getRegistry() {
+    static Registry registry;
+    return registry;
+  }
+
+ public:
+  static size_t current() {
+    thread_local Holder holder;
+    return holder.id;
+  }
+};
+
+/*
+ * Thread-safe Stack with flat combining: a thread publishes its request in its own slot,
+ * and whoever takes the lock applies all published requests as one Stack::batch(),
+ * i.e. with one check and one hash update for the whole group. A thread that finds
+ * the lock free doesn't publish anything: it applies its own request in place,
+ * together with the published ones.
+ *
+ * A thread that has published a request never blocks on the lock: it waits on its own slot
+ * and tries the lock only when nobody seems to hold it.
+ *
+ * A thread uses the slot with its ThreadIds number. Threads with numbers beyond SLOT_COUNT
+ * take the lock and do their work without combining.
+ * T has to be default constructible and move assignable.
+ */
+template<class T>
+class FlatCombiningStack {
+ private:
+  static const size_t SLOT_COUNT = 128;
+  // checks of the own slot before a waiter starts yielding the core
+  static const size_t SPIN_ATTEMPTS = 64;
+
+  enum Operation {
+    OP_NONE,
+    OP_PUSH,
+    OP_POP,
+    OP_TOP
+  };
+
+  /*
+   * std::mutex that tells whether it seems to be held, so waiters poll a flag instead of try_lock.
+   */
+  class CombinerMutex {
+   private:
+    std::mutex mutex_;
+    std::atomic<bool> held_{false};
+
+   public:
+    void lock() {
+      mutex_.lock();
+      held_.store(true, std::memory_order_relaxed);
+    }
+
+    bool try_lock() {
+      if (!mutex_.try_lock()) {
+        return false;
+      }
+      held_.store(true, std::memory_order_relaxed);
+      return true;
+    }
+
+    void unlock() {
+      held_.store(false, std::memory_order_relaxed);
+      mutex_.unlock();
+    }
+
+    bool looksHeld() const {
+      return held_.load(std::memory_order_relaxed);
+    }
+  };
+
+  struct alignas(CACHE_LINE_SIZE) Slot {
+    std::atomic<int> operation{OP_NONE};
+    StackError error{StackError::OK};
+    T value;
+  };
+
+  Stack<T> stack_;
+  CombinerMutex mutex_;
+  // slots take whole cache lines, std::allocator doesn't align to more than max_align_t before C++17
+  char* slot_bytes_;
+  Slot* slots_;
+  // the combiner looks only at slots [0, used_slots_)
+  std::atomic<size_t> used_slots_{0};
+
+  // the result of top() is left in value
+  static StackError apply(typename Stack<T>::Batch& batch, int operation, T& value) {
+    switch (operation) {
+      case OP_PUSH:
+        return batch.push(std::move(value));
+      case OP_POP:
+        return batch.pop();
+      case OP_TOP: {
+        StackResult<const T> result = batch.top();
+        if (result) {
+          value = result.value();
+        }
+        return result.error;
+      }
+      default:
+        return StackError::OK;
+    }
+  }
+
+  void applyPublished(typename Stack<T>::Batch& batch) {
+    size_t used_slots = used_slots_.load(std::memory_order_acquire);
+    for (size_t slot_id = 0; slot_id < used_slots; ++slot_id) {
+      Slot& slot = slots_[slot_id];
+      int operation = slot.operation.load(std::memory_order_acquire);
+      if (operation == OP_NONE) {
+        continue;
+      }
+      slot.error = apply(batch, operation, slot.value);
+      slot.operation.store(OP_NONE, std::memory_order_release);
+    }
+  }
+
+  // the caller holds the lock
+  StackError executeLocked(Operation operation, T& value) {
+    StackError error = StackError::OK;
+    stack_.batch([&](typename Stack<T>::Batch& batch) {
+      error = apply(batch, operation, value);
+      applyPublished(batch);
+    });
+    return error;
+  }
+
+  // returns the error of the request, the result of top() is left in slot.value
+  StackError execute(Slot& slot, Operation operation) {
+    slot.operation.store(operation, std::memory_order_release);
+    for (size_t attempt = 0; slot.operation.load(std::memory_order_acquire) != OP_NONE; ++attempt) {
+      // while the combiner works, wait for it to serve the slot; after a few checks give it the core
+      if (mutex_.looksHeld() || !mutex_.try_lock()) {
+        if (attempt >= SPIN_ATTEMPTS) {
+          std::this_thread::yield();
+        }
+        continue;
+      }
+      std::lock_guard<CombinerMutex> lock(mutex_, std::adopt_lock);
+      if (slot.operation.load(std::memory_order_acquire) != OP_NONE) {
+        stack_.batch([this](typename Stack<T>::Batch& batch) {
+          applyPublished(batch);
+        });
+      }
+    }
+    return slot.error;
+  }
+
+  StackError execute(Operation operation, T& value) {
+    if (mutex_.try_lock()) {
+      std::lock_guard<CombinerMutex> lock(mutex_, std::adopt_lock);
+      return executeLocked(operation, value);
+    }
+
+    size_t thread_id = ThreadIds::current();
+    if (thread_id >= SLOT_COUNT) {
+      std::lock_guard<CombinerMutex> lock(mutex_);
+      return executeLocked(operation, value);
+    }
+    size_t used_slots = used_slots_.load(std::memory_order_relaxed);
+    while (used_slots <= thread_id && !used_slots_.compare_exchange_weak(used_slots, thread_id + 1)) {
+    }
+    Slot& slot = slots_[thread_id];
+    slot.value = std::move(value);
+    StackError error = execute(slot, operation);
+    value = std::move(slot.value);
+    return error;
+  }
+
+ public:
+  FlatCombiningStack() {
+    slot_bytes_ = alignedAllocate(SLOT_COUNT * sizeof(Slot), alignof(Slot));
+    if (slot_bytes_ == nullptr) {
+      throw std::bad_alloc();
+    }
+    slots_ = reinterpret_cast<Slot*>(slot_bytes_);
+    for (size_t slot_id = 0; slot_id < SLOT_COUNT; ++slot_id) {
+      new (slots_ + slot_id) Slot();
+    }
+  }
+
+  FlatCombiningStack(const FlatCombiningStack&) = delete;
+  FlatCombiningStack& operator=(const FlatCombiningStack&) = delete;
+
+  void push(T value) {
+    StackError error = execute(OP_PUSH, value);
+    if (error == StackError::BAD_ALLOC) {
+      throw std::bad_alloc();
+    }
+  }
+
+  void pop() {
+    T value = T();
+    if (execute(OP_POP, value) == StackError::EMPTY_STACK) {
+      throw EmptyStackException("", __PRETTY_FUNCTION__);
+    }
+  }
+
+  T top() {
+    T value = T();
+    if (execute(OP_TOP, value) == StackError::EMPTY_STACK) {
+      throw EmptyStackException("", __PRETTY_FUNCTION__);
+    }
+    return value;
+  }
+
+  /*
+   * Exclusive access to the whole Stack interface: indexing, dump(), check() and so on.
+   */
+  template<class Function>
+  void locked(Function function) {
+    std::lock_guard<CombinerMutex> lock(mutex_);
+    function(stack_);
+  }
+
+  ~FlatCombiningStack() {
+    for (size_t slot_id = 0; slot_id < SLOT_COUNT; ++slot_id) {
+      slots_[slot_id].~Slot();
+    }
+    alignedFree(slot_bytes_);
+  }
+};
+
+#endif //STACK_FLAT_COMBINING_STACK_H
@@ -0,0 +1,98 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "memory_layout.h"
+#include "my_stack.h"
+
+/*
+ * Effect of the item alignment on bulk reads and copies.
+ * "offset 4" is the layout Stack used to have in debug builds: items right after a 4-byte canary.
+ * The checked build of Stack logs to stderr, so redirect it: ./layout_benchmark 2>/dev/null
+ */
+
+#ifdef NDEBUG
+const char* MODE = "unchecked";
+#else
+const char* MODE = "checked";
+#endif
+
+template<class Function>
+double measure(Function function, size_t repeats) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t repeat = 0; repeat < repeats; ++repeat) {
+    function();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void rawBenchmark(size_t offset, size_t item_count, size_t repeats) {
+  char* from_bytes = alignedAllocate(item_count * sizeof(double) + CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+  char* to_bytes = alignedAllocate(item_count * sizeof(double) + CACHE_LINE_SIZE, CACHE_LINE_SIZE);
+  double* from = reinterpret_cast<double*>(from_bytes + offset);
+  double* to = reinterpret_cast<double*>(to_bytes + offset);
+  for (size_t item_id = 0; item_id < item_count; ++item_id) {
+    from[item_id] = item_id;
+  }
+
+  volatile double sink = 0;
+  double read_ms = measure([&]() {
+    double sum = 0;
+    for (size_t item_id = 0; item_id < item_count; ++item_id) {
+      sum += from[item_id];
+    }
+    sink = sum;
+  }, repeats);
+  double copy_ms = measure([&]() {
+    for (size_t item_id = 0; item_id < item_count; ++item_id) {
+      to[item_id] = from[item_id];
+    }
+  }, repeats);
+  (void)sink;
+
+  std::printf("%-10s raw double, offset %-2zu  read %8.2f ms  copy %8.2f ms\n", MODE, offset, read_ms, copy_ms);
+  alignedFree(from_bytes);
+  alignedFree(to_bytes);
+}
+
+template<class Container>
+void stackBenchmark(const char* name, size_t item_count, size_t repeats) {
+  Container st(item_count, 1.0);
+  size_t misalignment = reinterpret_cast<uintptr_t>(&st[0]) % CACHE_LINE_SIZE;
+
+  // the view is checked once per call, so the loop reads the items as a raw array would
+  typename Container::View view = st.view();
+  volatile double sink = 0;
+  double read_ms = measure([&]() {
+    double sum = 0;
+    for (double item : view) {
+      sum += item;
+    }
+    sink = sum;
+  }, repeats);
+  (void)sink;
+
+  double copy_ms = measure([&]() {
+    Container copy(st);
+  }, repeats);
+  std::printf("%-10s %-18s  first item at line offset %-2zu  read %8.2f ms  copy %8.2f ms\n",
+              MODE, name, misalignment, read_ms, copy_ms);
+}
+
+int main(int argc, char** argv) {
+  size_t item_count = (argc > 1 ? std::stoul(argv[1]) : 1 << 20);
+  const size_t repeats = 20;
+
+  try {
+    rawBenchmark(4, item_count, repeats);
+    rawBenchmark(0, item_count, repeats);
+    stackBenchmark<Stack<double>>("Stack<double>", item_count, repeats);
+    stackBenchmark<Stack<double, 64>>("Stack<double, 64>", item_count, repeats);
+  } catch (StackException& exc) {
+    std::cerr << exc;
+    return 1;
+  }
+  return 0;
+}
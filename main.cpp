@@ -2,6 +2,7 @@
 #include <iostream>
 #include "my_stack.h"
 #include "crash_test.h"
+#include "api_test.h"
 //#define DEBUG
 //#include "logipamar_stack.h"
 
@@ -34,5 +35,5 @@ int main() {
   } catch (StackException& stackException) {
     std::cerr << stackException << '\n';
   }
-  return 0;
+  return runApiTests() ? 0 : 1;
 }
\ No newline at end of file
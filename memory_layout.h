@@ -0,0 +1,44 @@
+#ifndef STACK_MEMORY_LAYOUT_H
+#define STACK_MEMORY_LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+const size_t CACHE_LINE_SIZE = 64;
+
+constexpr size_t alignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+constexpr bool isPowerOfTwo(size_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+/*
+ * new char[] guarantees only alignof(max_align_t), so the buffer is over-allocated
+ * and the original pointer is kept right before the aligned block.
+ * Returns nullptr if there is no memory.
+ */
+inline char* alignedAllocate(size_t size, size_t alignment) {
+  char* raw = static_cast<char*>(::operator new(size + alignment - 1 + sizeof(void*), std::nothrow));
+  if (raw == nullptr) {
+    return nullptr;
+  }
+  uintptr_t aligned = alignUp(reinterpret_cast<uintptr_t>(raw) + sizeof(void*), alignment);
+  char* result = reinterpret_cast<char*>(aligned);
+  std::memcpy(result - sizeof(void*), &raw, sizeof(void*));
+  return result;
+}
+
+inline void alignedFree(char* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  void* raw = nullptr;
+  std::memcpy(&raw, ptr - sizeof(void*), sizeof(void*));
+  ::operator delete(raw);
+}
+
+#endif //STACK_MEMORY_LAYOUT_H
@@ -1,13 +1,20 @@
 #ifndef STACK_MY_STACK_H
 #define STACK_MY_STACK_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
 #include <utility>
 
 #include "exception.h"
+#include "memory_layout.h"
+#include "parallel_hash.h"
 
 #ifndef NDEBUG
-  #define CALC_HASHES() { hash_sum_ = calcHashSum(); full_hash_ = calcFullHash(); }
+  #define CALC_HASHES() { ++*version_; hash_sum_ = calcHashSum(); full_hash_ = calcFullHash(); }
   #define ASSERT_CORRECTNESS() { assertCorrectness(__PRETTY_FUNCTION__); }
   #define ASSERT_PARAMS() { assertParams(__PRETTY_FUNCTION__); }
   #define ASSERT_POINTERS() { assertPointers(__PRETTY_FUNCTION__); }
@@ -16,8 +23,133 @@
   #define ASSERT_CORRECTNESS() {}
 #endif
 
-template<class T>
+/*
+ * ALIGNMENT is the alignment of the first item, e.g. Stack<float, 64> for vectorized consumers.
+ */
+template<class T, size_t ALIGNMENT = alignof(T)>
 class Stack {
+  static_assert(isPowerOfTwo(ALIGNMENT) && ALIGNMENT >= alignof(T), "incorrect alignment of items");
+
+ public:
+  struct Savepoint {
+    size_t depth;
+    size_t serial;
+  };
+
+  /*
+   * Read-only contiguous range of items. The stack is checked once when the view is made,
+   * the items are read without any checks after that. Without NDEBUG the view throws
+   * from begin/end/data/operator[] if the stack was changed or destroyed since then:
+   * the version it compares with outlives the stack.
+   */
+  class View {
+   private:
+    const T* data_;
+    size_t size_;
+#ifndef NDEBUG
+    std::shared_ptr<const size_t> stack_version_;
+    size_t version_;
+#endif
+
+    void assertActual(const char* func_name) const {
+#ifndef NDEBUG
+      if (*stack_version_ != version_) {
+        throw InvalidatedViewException("the stack was changed or destroyed after the view had been made", func_name);
+      }
+#else
+      (void)func_name;
+#endif
+    }
+
+    friend class Stack;
+
+    explicit View(const Stack* stack): data_(stack->getElementPtr(0)), size_(stack->item_count_) {
+#ifndef NDEBUG
+      stack_version_ = stack->version_;
+      version_ = *stack->version_;
+#endif
+    }
+
+   public:
+    typedef const T* const_iterator;
+    typedef const T* iterator;
+
+    const T* data() const {
+      assertActual(__PRETTY_FUNCTION__);
+      return data_;
+    }
+
+    const T* begin() const {
+      assertActual(__PRETTY_FUNCTION__);
+      return data_;
+    }
+
+    const T* end() const {
+      assertActual(__PRETTY_FUNCTION__);
+      return data_ + size_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    const T& operator[](size_t pos) const {
+      assertActual(__PRETTY_FUNCTION__);
+      return data_[pos];
+    }
+  };
+
+  /*
+   * Modifications made inside Stack::batch(). They are not checked one by one
+   * and report problems through StackError.
+   */
+  class Batch {
+   private:
+    Stack& stack_;
+    // the buffer is shrunk after the batch only if something was popped
+    bool popped_{false};
+
+    friend class Stack;
+
+    explicit Batch(Stack& stack): stack_(stack) {}
+
+   public:
+    StackError push(const T& value) {
+      return stack_.pushUnchecked(value);
+    }
+
+    StackError push(T&& value) {
+      return stack_.pushUnchecked(std::move(value));
+    }
+
+    StackError pop() {
+      if (stack_.item_count_ == 0) {
+        return StackError::EMPTY_STACK;
+      }
+      stack_.truncate(stack_.item_count_ - 1);
+      popped_ = true;
+#ifndef NDEBUG
+      ++*stack_.version_;
+#endif
+      return StackError::OK;
+    }
+
+    StackResult<const T> top() const {
+      if (stack_.item_count_ == 0) {
+        return StackResult<const T>(StackError::EMPTY_STACK);
+      }
+      return StackResult<const T>(StackError::OK, stack_.getElementPtr(stack_.item_count_ - 1));
+    }
+
+    size_t size() const {
+      return stack_.item_count_;
+    }
+  };
+
  private:
   static const size_t EXPANSION_COEFF = 2;
   static const size_t SHRINKAGE_COEFF = 2;
@@ -25,42 +157,104 @@ class Stack {
   constexpr static double MIN_LOAD_FACTOR = 0.25;
   static const size_t MIN_CAPACITY = 8;
 #ifndef NDEBUG
-  static const size_t CANARY_SIZE = 4;
+  // the first canary takes a whole cache line, so the items start on a new line
+  static const size_t CANARY_SIZE = alignUp(CACHE_LINE_SIZE, ALIGNMENT);
+  static const size_t BUFFER_ALIGNMENT = (ALIGNMENT > CACHE_LINE_SIZE ? ALIGNMENT : CACHE_LINE_SIZE);
   static const uint32_t CANARY_INIT_VALUE = 1983776228;
 
   size_t main_canary_{CANARY_INIT_VALUE};
 
 #else
   static const size_t CANARY_SIZE = 0;
+  static const size_t BUFFER_ALIGNMENT = ALIGNMENT;
 #endif
 
   char* bytes_{nullptr};
   size_t capacity_{0};
   size_t item_count_{0};
   char* items_begin_{nullptr};
+
+  struct SavedState {
+    size_t serial;
+    size_t item_count;
+    size_t hash_sum;
+  };
+
+  struct Savepoints {
+    std::vector<SavedState> states;
+  };
+
+  // serials are shared by all stacks of the type, so a savepoint of one stack is rejected by another
+  static size_t nextSavepointSerial() {
+    static std::atomic<size_t> last_serial{0};
+    return last_serial.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  // allocated by the first mark(), so stacks without savepoints pay only for the pointer
+  Savepoints* savepoints_{nullptr};
 #ifndef NDEBUG
   size_t hash_sum_{0};
   char* bytes_copy_{nullptr};
   std::hash<T> hasher_;
   size_t full_hash_{0};
+  // changes on every modification and on destruction, so that a View can tell that it is out of date;
+  // it is shared with views, so they can read it after the stack is gone
+  std::shared_ptr<size_t> version_{std::make_shared<size_t>(0)};
 
+  // the first canary is right before the items, so an underflow hits it first
   uint32_t* getCanaryPtr1() const {
-    return reinterpret_cast<uint32_t*>(bytes_);
+    return reinterpret_cast<uint32_t*>(items_begin_ - sizeof(uint32_t));
   }
 
-  uint32_t* getCanaryPtr2() const {
+  // the sentinel is right after the last item, so an overflow by a single item hits it too
+  uint32_t* getSentinelPtr() const {
     return reinterpret_cast<uint32_t*>(items_begin_ + capacity_ * sizeof(T));
   }
 
+  // the second canary starts its own cache line after the sentinel
+  uint32_t* getCanaryPtr2() const {
+    return reinterpret_cast<uint32_t*>(items_begin_ + getItemsAreaSize(capacity_));
+  }
+
   void initCanaries() {
     main_canary_ = CANARY_INIT_VALUE;
 #ifndef DEBUG
     ASSERT_POINTERS();
 #endif
     *getCanaryPtr1() = CANARY_INIT_VALUE;
+    *getSentinelPtr() = CANARY_INIT_VALUE;
     *getCanaryPtr2() = CANARY_INIT_VALUE;
   }
 #endif
+  /*
+   * Buffer layout: [canary line][items][sentinel, padded to a cache line][canary line],
+   * canaries and the sentinel exist only without NDEBUG. The canaries never share a line with items,
+   * the sentinel shares the last line of items unless they end on a line boundary.
+   */
+  static size_t getItemsAreaSize(size_t capacity) {
+#ifndef NDEBUG
+    return alignUp(capacity * sizeof(T) + sizeof(uint32_t), CACHE_LINE_SIZE);
+#else
+    return capacity * sizeof(T);
+#endif
+  }
+
+  static size_t getBufferSize(size_t capacity) {
+#ifndef NDEBUG
+    return CANARY_SIZE + getItemsAreaSize(capacity) + CACHE_LINE_SIZE;
+#else
+    return getItemsAreaSize(capacity);
+#endif
+  }
+
+  static char* allocateBuffer(size_t capacity) {
+    char* buffer = alignedAllocate(getBufferSize(capacity), BUFFER_ALIGNMENT);
+    if (buffer == nullptr) {
+      throw std::bad_alloc();
+    }
+    return buffer;
+  }
+
   const T* getElementPtr(size_t pos) const {
     return reinterpret_cast<T*>(items_begin_ + pos * sizeof(T));
   }
@@ -69,12 +263,12 @@ class Stack {
     return reinterpret_cast<T*>(items_begin_ + pos * sizeof(T));
   }
 
+  // copy-constructs item_count_ items, the callers have already checked the source stack
   void copyItems(const char* from, char* to) {
     if (from == nullptr || to == nullptr) {
       throw IncorrectPointerException("pointer equals nullptr", __PRETTY_FUNCTION__);
     }
 
-    ASSERT_CORRECTNESS();
 #ifndef NDEBUG
     std::cerr << "copy items begin\n";
 #endif
@@ -83,23 +277,31 @@ class Stack {
     T* new_item = reinterpret_cast<T*>(to + CANARY_SIZE);
 
     for (size_t item_id = 0; item_id < item_count_; ++item_id, ++cur_item, ++new_item) {
-      *new_item = *cur_item;
+      new (new_item) T(*cur_item);
     }
 #ifndef NDEBUG
     std::cerr << "copy items end\n";
 #endif
   }
 
-  void setCapacity(size_t new_capacity) {
-    ASSERT_CORRECTNESS();
+  bool reallocate(size_t new_capacity) {
     if (capacity_ == new_capacity) {
-      return;
+      return true;
     }
 
-    char* new_bytes = new char[new_capacity * sizeof(T) + 2 * CANARY_SIZE + 1];
+    char* new_bytes = alignedAllocate(getBufferSize(new_capacity), BUFFER_ALIGNMENT);
+    if (new_bytes == nullptr) {
+      return false;
+    }
 
+    moveToBuffer(new_bytes, new_capacity);
+    return true;
+  }
+
+  // copies the items to new_bytes and frees the old buffer
+  void moveToBuffer(char* new_bytes, size_t new_capacity) {
     copyItems(bytes_, new_bytes);
-    destroy();
+    freeItems();
     setBytesPtr(new_bytes);
     items_begin_ = bytes_ + CANARY_SIZE;
     capacity_ = new_capacity;
@@ -109,10 +311,38 @@ class Stack {
 #endif
   }
 
-  void extend() {
+  void setCapacity(size_t new_capacity) {
     ASSERT_CORRECTNESS();
-    setCapacity(capacity_ * 2);
-    CALC_HASHES();
+    if (!reallocate(new_capacity)) {
+      throw std::bad_alloc();
+    }
+  }
+
+  /*
+   * Destroys items [new_count, item_count_) and forgets the savepoints above new_count:
+   * the items under them can be replaced now.
+   */
+  void truncate(size_t new_count) {
+    for (size_t item_id = new_count; item_id < item_count_; ++item_id) {
+      getElementPtr(item_id)->~T();
+    }
+    item_count_ = new_count;
+    if (savepoints_ == nullptr) {
+      return;
+    }
+    std::vector<SavedState>& states = savepoints_->states;
+    while (!states.empty() && states.back().item_count > item_count_) {
+      states.pop_back();
+    }
+  }
+
+  size_t findSavepoint(const Savepoint& savepoint, const char* func_name) const {
+    if (savepoints_ == nullptr || savepoint.depth >= savepoints_->states.size()
+        || savepoints_->states[savepoint.depth].serial != savepoint.serial) {
+      throw IncorrectArgumentException("the savepoint was already rolled back, committed or popped through",
+                                       func_name);
+    }
+    return savepoint.depth;
   }
 
   void shrink() {
@@ -126,24 +356,32 @@ class Stack {
       return;
     }
     ASSERT_CORRECTNESS();
+    freeItems();
+  }
+
+  void freeItems() {
 #ifndef NDEBUG
     std::cerr << "try to destroy old items\n";
 #endif
     for (size_t item_id = 0; item_id < item_count_; ++item_id) {
       getElementPtr(item_id)->~T();
     }
-    delete[] bytes_;
+    alignedFree(bytes_);
   }
 
   template <class StackRef>
   void copyParameters(const StackRef&& another) {
+#ifndef NDEBUG
     another.assertCorrectness(__PRETTY_FUNCTION__);
+#endif
     capacity_ = another.capacity_;
     item_count_ = another.item_count_;
 #ifndef NDEBUG
     initCanaries();
     hasher_ = another.hasher_;
-    CALC_HASHES();
+    // items may be not copied yet, but they will be the same
+    hash_sum_ = another.hash_sum_;
+    full_hash_ = calcFullHash();
 #endif
   }
 
@@ -170,6 +408,14 @@ class Stack {
       all_fine = false;
     }
 
+    std::cerr << "sentinel = " << ' ' << *getSentinelPtr() << '\n';
+    if (*getSentinelPtr() == CANARY_INIT_VALUE) {
+      std::cerr << "OK\n";
+    } else {
+      std::cerr << "incorrect value! should be " << CANARY_INIT_VALUE << '\n';
+      all_fine = false;
+    }
+
     std::cerr << "canary 2 = " << ' ' << *getCanaryPtr2() << '\n';
     if (*getCanaryPtr2() == CANARY_INIT_VALUE) {
       std::cerr << "OK\n";
@@ -235,12 +481,7 @@ class Stack {
   }
 
   bool checkParams() const {
-    try {
-      assertParams();
-      return true;
-    } catch (StackException&) {
-      return false;
-    }
+    return paramsIntact();
   }
 
   void printItems() const {
@@ -264,26 +505,31 @@ class Stack {
     assertParams(__PRETTY_FUNCTION__);
     assertPointers(__PRETTY_FUNCTION__);
 
-    size_t res = item_count_;
-
-    for (size_t item_id = 0; item_id < item_count_; ++item_id) {
-      res = (res * BASE + hasher_(*getElementPtr(item_id))) % MODULO;
+    if (item_count_ >= STACK_PARALLEL_HASH_THRESHOLD) {
+      return calcPolynomialHashParallel(WorkerPool::instance(), getElementPtr(0), item_count_, item_count_,
+                                        hasher_, BASE, MODULO);
     }
-    return res;
+    return calcPolynomialHash(getElementPtr(0), item_count_, item_count_, hasher_, BASE, MODULO);
   }
 
   size_t calcFullHash() const {
     const char* const_hack_ptr = reinterpret_cast<const char*>(this);
+    // the saved full hash can't be a part of itself
+    const char* skip_begin = reinterpret_cast<const char*>(&full_hash_);
+    const char* skip_end = skip_begin + sizeof(full_hash_);
 
     size_t byte_cnt = sizeof(Stack);
     size_t res = 0;
     for (size_t byte_id = 0; byte_id < byte_cnt; ++byte_id, ++const_hack_ptr) {
+      if (const_hack_ptr >= skip_begin && const_hack_ptr < skip_end) {
+        continue;
+      }
       res = (res * BASE + std::hash<char>()(*const_hack_ptr)) % MODULO;
     }
     return res;
   }
 
-  void assertParams(const std::string& func_name = "") const {
+  bool paramsIntact() const {
     bool correct = true;
 
     correct &= (EXPANSION_COEFF == 2);
@@ -291,33 +537,54 @@ class Stack {
     correct &= (MAX_LOAD_FACTOR == 0.5);
     correct &= (MIN_LOAD_FACTOR == 0.25);
     correct &= (MIN_CAPACITY == 8);
-    correct &= (CANARY_SIZE == 4);
+    correct &= (CANARY_SIZE % CACHE_LINE_SIZE == 0);
     correct &= (CANARY_INIT_VALUE == 1983776228);
-    if (!correct) {
+    return correct;
+  }
+
+  bool pointersIntact() const {
+    return bytes_copy_ == bytes_ && items_begin_ == bytes_ + CANARY_SIZE
+        && capacity_ >= 8 && item_count_ <= capacity_ * MAX_LOAD_FACTOR;
+  }
+
+  bool canariesIntact() const {
+    return main_canary_ == CANARY_INIT_VALUE
+        && *getCanaryPtr1() == CANARY_INIT_VALUE && *getSentinelPtr() == CANARY_INIT_VALUE
+        && *getCanaryPtr2() == CANARY_INIT_VALUE;
+  }
+
+  bool hashSumIntact() const {
+    return full_hash_ == calcFullHash() && hash_sum_ == calcHashSum();
+  }
+
+  void assertParams(const char* func_name = "") const {
+    if (!paramsIntact()) {
       throw ParamsPoisonedException("parameters are corrupted", func_name);
     }
   }
 
-  void assertPointers(const std::string& func_name = "") const {
-    if (bytes_copy_ != bytes_ || items_begin_ != bytes_ + CANARY_SIZE
-        || capacity_ < 8 || item_count_ > capacity_ * MAX_LOAD_FACTOR) {
+  void assertPointers(const char* func_name = "") const {
+    if (!pointersIntact()) {
       throw IncorrectPointerException("pointers are destroyed", func_name);
     }
   }
 
-  void assertCanaries(const std::string& func_name = "") const {
+  void assertCanaries(const char* func_name = "") const {
     if (main_canary_ != CANARY_INIT_VALUE) {
       throw CanaryException("problem with main canary", func_name);
     }
     if (*getCanaryPtr1() != CANARY_INIT_VALUE) {
       throw CanaryException("problem with first canary", func_name);
     }
+    if (*getSentinelPtr() != CANARY_INIT_VALUE) {
+      throw CanaryException("problem with the sentinel after the items", func_name);
+    }
     if (*getCanaryPtr2() != CANARY_INIT_VALUE) {
       throw CanaryException("problem with second canary", func_name);
     }
   }
 
-  void assertHashSum(const std::string& func_name = "") const {
+  void assertHashSum(const char* func_name = "") const {
     if (full_hash_ != calcFullHash()) {
       throw HashSumException("main hash was crashed", func_name);
     }
@@ -326,20 +593,41 @@ class Stack {
     }
   }
 
-  void assertCorrectness(const std::string& func_name) const {
-    try {
-      assertParams(func_name);
-      assertPointers(func_name);
-      assertCanaries(func_name);
-      assertHashSum(func_name);
-    } catch (StackException& exc) {
-      dump(func_name);
-      std::cerr << "\n\n";
-      throw exc;
+  /*
+   * The healthy path neither allocates nor throws: exceptions (and their strings)
+   * are built only after a problem has been found.
+   */
+  void assertCorrectness(const char* func_name = "") const {
+    if (findCorruption() == StackError::OK) {
+      return;
     }
+    dump(func_name);
+    std::cerr << "\n\n";
+    assertParams(func_name);
+    assertPointers(func_name);
+    assertCanaries(func_name);
+    assertHashSum(func_name);
   }
 #endif
 
+  StackError findCorruption() const {
+#ifndef NDEBUG
+    if (!paramsIntact()) {
+      return StackError::PARAMS_POISONED;
+    }
+    if (!pointersIntact()) {
+      return StackError::INCORRECT_POINTER;
+    }
+    if (!canariesIntact()) {
+      return StackError::CANARY;
+    }
+    if (!hashSumIntact()) {
+      return StackError::HASH_SUM;
+    }
+#endif
+    return StackError::OK;
+  }
+
  void setBytesPtr(char* new_bytes) {
    bytes_ = new_bytes;
 #ifndef NDEBUG
@@ -347,19 +635,79 @@ class Stack {
 #endif
  }
 
- T& get(size_t pos) {
+ const T& get(size_t pos) const {
     if (pos >= item_count_) {
       throw OutOfRangeException("the argument is more than the number of elements", __PRETTY_FUNCTION__);
     }
+    ASSERT_CORRECTNESS();
+    return *getElementPtr(pos);
+  }
+
+  /*
+   * Neither checks the stack nor updates the hashes. The value may be an item of this stack,
+   * so on growth it is constructed in the new buffer before the old one is freed.
+   */
+  template<class U>
+  StackError pushUnchecked(U&& value) {
+    if ((item_count_ + 1) <= MAX_LOAD_FACTOR * capacity_) {
+      new (getElementPtr(item_count_)) T(std::forward<U>(value));
+      ++item_count_;
+      return StackError::OK;
+    }
+
+    size_t new_capacity = capacity_ * EXPANSION_COEFF;
+    char* new_bytes = alignedAllocate(getBufferSize(new_capacity), BUFFER_ALIGNMENT);
+    if (new_bytes == nullptr) {
+      return StackError::BAD_ALLOC;
+    }
+    T* new_item = reinterpret_cast<T*>(new_bytes + CANARY_SIZE) + item_count_;
+    try {
+      new (new_item) T(std::forward<U>(value));
+    } catch (...) {
+      alignedFree(new_bytes);
+      throw;
+    }
+    moveToBuffer(new_bytes, new_capacity);
+    ++item_count_;
 #ifndef NDEBUG
-    assertCorrectness();
+    ++*version_;
 #endif
-    return *getElementPtr(pos);
+    return StackError::OK;
+  }
+
+  template<class U>
+  StackError tryPushImpl(U&& value) {
+    StackError error = findCorruption();
+    if (error != StackError::OK) {
+      return error;
+    }
+    error = pushUnchecked(std::forward<U>(value));
+    CALC_HASHES();
+    return error;
+  }
+
+  void finishBatch(const Batch& batch) {
+    if (batch.popped_) {
+      fitCapacity();
+    }
+    CALC_HASHES();
+  }
+
+  /*
+   * Shrinks the buffer to the load factor in one step, returns true if the buffer was changed.
+   * If there is no memory for a smaller buffer we simply keep the current one.
+   */
+  bool fitCapacity() {
+    size_t new_capacity = capacity_;
+    while (new_capacity > MIN_CAPACITY && item_count_ < MIN_LOAD_FACTOR * new_capacity) {
+      new_capacity /= SHRINKAGE_COEFF;
+    }
+    return new_capacity != capacity_ && reallocate(new_capacity);
   }
 
  public:
   Stack() {
-    setBytesPtr(new char[MIN_CAPACITY * sizeof(T) + 2 * CANARY_SIZE + 1]);
+    setBytesPtr(allocateBuffer(MIN_CAPACITY));
     items_begin_ = bytes_ + CANARY_SIZE;
     capacity_ = MIN_CAPACITY;
 #ifndef NDEBUG
@@ -376,9 +724,10 @@ class Stack {
       optimal_capacity *= 2;
     }
     setCapacity(optimal_capacity);
-    for (size_t item_id = 0; item_id < item_count_; ++item_id) {
-      *getElementPtr(item_id) = value;
+    for (size_t item_id = 0; item_id < size; ++item_id) {
+      new (getElementPtr(item_id)) T(value);
     }
+    item_count_ = size;
     CALC_HASHES();
   }
 
@@ -389,7 +738,13 @@ class Stack {
     setBytesPtr(another.bytes_);
     items_begin_ = bytes_ + CANARY_SIZE;
     copyParameters(std::move(another));
+    savepoints_ = another.savepoints_;
+    another.savepoints_ = nullptr;
     another.setBytesPtr(nullptr);
+#ifndef NDEBUG
+    // views of the moved-from stack point into the buffer that is ours now
+    ++*another.version_;
+#endif
     CALC_HASHES();
   }
 
@@ -397,12 +752,9 @@ class Stack {
 #ifndef NDEBUG
     another.assertCorrectness(__PRETTY_FUNCTION__);
 #endif
-    setBytesPtr(new char[2 * CANARY_SIZE + another.capacity_ * sizeof(T) + 1]);
+    setBytesPtr(allocateBuffer(another.capacity_));
     items_begin_ = bytes_ + CANARY_SIZE;
-    std::cerr << "copy par\n";
     copyParameters(std::forward<const Stack>(another));
-    std::cerr << "copy par finished\n";
-    std::cerr << item_count_ << ' ' << another.item_count_ << '\n';
     copyItems(another.bytes_, bytes_);
     CALC_HASHES();
   }
@@ -417,6 +769,17 @@ class Stack {
     return item_count_ > 0;
   }
 
+  /*
+   * Bytes taken by the object itself, by its buffer and by its savepoints.
+   */
+  size_t memoryUsage() const {
+    size_t savepoint_bytes = 0;
+    if (savepoints_ != nullptr) {
+      savepoint_bytes = sizeof(Savepoints) + savepoints_->states.capacity() * sizeof(SavedState);
+    }
+    return sizeof(Stack) + getBufferSize(capacity_) + savepoint_bytes;
+  }
+
   T& operator=(Stack&& another) {
     if (this == &another) {
       return *this;
@@ -430,6 +793,9 @@ class Stack {
     items_begin_ = bytes_ + CANARY_SIZE;
     copyParameters(another);
     another.setBytesPtr(nullptr);
+#ifndef NDEBUG
+    ++*another.version_;
+#endif
     CALC_HASHES();
     return *this;
   }
@@ -444,7 +810,7 @@ class Stack {
 #endif
     destroy();
     std::cerr << "old one was destroyed\n";
-    setBytesPtr(new char[2 * CANARY_SIZE + another.capacity_ * sizeof(T) + 1]);
+    setBytesPtr(allocateBuffer(another.capacity_));
     items_begin_ = bytes_ + CANARY_SIZE;
     std::cerr << "pointers were set\n";
     copyParameters(another);
@@ -463,21 +829,17 @@ class Stack {
 
   void push(const T& value) {
     ASSERT_CORRECTNESS();
-    if ((item_count_ + 1) > MAX_LOAD_FACTOR * capacity_) {
-      extend();
+    if (pushUnchecked(value) == StackError::BAD_ALLOC) {
+      throw std::bad_alloc();
     }
-    *getElementPtr(item_count_) = value;
-    ++item_count_;
     CALC_HASHES();
   }
 
   void push(T&& value) {
     ASSERT_CORRECTNESS();
-    if ((item_count_ + 1) > MAX_LOAD_FACTOR * capacity_) {
-      extend();
+    if (pushUnchecked(std::move(value)) == StackError::BAD_ALLOC) {
+      throw std::bad_alloc();
     }
-    *getElementPtr(item_count_) = std::move(value);
-    ++item_count_;
     CALC_HASHES();
   }
 
@@ -486,11 +848,11 @@ class Stack {
     if (item_count_ == 0) {
       throw EmptyStackException("", __PRETTY_FUNCTION__);
     }
-    if (capacity_ > MIN_CAPACITY && (item_count_ - 1) < MIN_LOAD_FACTOR * capacity_) {
+    truncate(item_count_ - 1);
+    CALC_HASHES();
+    if (capacity_ > MIN_CAPACITY && item_count_ < MIN_LOAD_FACTOR * capacity_) {
       shrink();
     }
-    --item_count_;
-    CALC_HASHES();
   }
 
   const T& top() const {
@@ -498,20 +860,145 @@ class Stack {
     return get(item_count_ - 1);
   }
 
-#ifndef NDEBUG
-  bool check() const {
+  View view() const {
+    ASSERT_CORRECTNESS();
+    return View(this);
+  }
+
+  /*
+   * Calls function(Batch&) with one check of the stack before it and one hash update after it.
+   * The buffer is shrunk once at the end instead of on every pop.
+   * Views are invalidated inside the batch by pops and by pushes that grow the buffer.
+   */
+  template<class Function>
+  void batch(Function function) {
+    ASSERT_CORRECTNESS();
+    Batch batch(*this);
     try {
-      assertParams();
-      assertPointers();
-      assertCanaries();
-      assertHashSum();
-      return true;
-    } catch (StackException&) {
-      return false;
+      function(batch);
+    } catch (...) {
+      finishBatch(batch);
+      throw;
+    }
+    finishBatch(batch);
+  }
+
+  /*
+   * Non-throwing versions of push/pop/top/operator[] for code where exceptions are banned.
+   * Corruption is reported through the returned code instead of dump + exception.
+   */
+  StackError tryPush(const T& value) {
+    return tryPushImpl(value);
+  }
+
+  StackError tryPush(T&& value) {
+    return tryPushImpl(std::move(value));
+  }
+
+  StackError tryPop() {
+    StackError error = findCorruption();
+    if (error != StackError::OK) {
+      return error;
+    }
+    if (item_count_ == 0) {
+      return StackError::EMPTY_STACK;
+    }
+    truncate(item_count_ - 1);
+    // if there is no memory for a smaller buffer we simply keep the current one
+    if (capacity_ > MIN_CAPACITY && item_count_ < MIN_LOAD_FACTOR * capacity_) {
+      reallocate(capacity_ / SHRINKAGE_COEFF);
+    }
+    CALC_HASHES();
+    return StackError::OK;
+  }
+
+  StackResult<const T> tryTop() const {
+    StackError error = findCorruption();
+    if (error != StackError::OK) {
+      return StackResult<const T>(error);
+    }
+    if (item_count_ == 0) {
+      return StackResult<const T>(StackError::EMPTY_STACK);
+    }
+    return StackResult<const T>(StackError::OK, getElementPtr(item_count_ - 1));
+  }
+
+  StackResult<const T> tryAt(size_t pos) const {
+    StackError error = findCorruption();
+    if (error != StackError::OK) {
+      return StackResult<const T>(error);
     }
+    if (pos >= item_count_) {
+      return StackResult<const T>(StackError::OUT_OF_RANGE);
+    }
+    return StackResult<const T>(StackError::OK, getElementPtr(pos));
+  }
+
+  /*
+   * Savepoints for speculative pushes. Nested ones are allowed, rolling back or committing
+   * a savepoint also drops all savepoints made after it. Popping below a savepoint drops it too.
+   */
+  Savepoint mark() {
+    ASSERT_CORRECTNESS();
+    if (savepoints_ == nullptr) {
+      savepoints_ = new Savepoints();
+    }
+    SavedState state;
+    state.serial = nextSavepointSerial();
+    state.item_count = item_count_;
+#ifndef NDEBUG
+    state.hash_sum = hash_sum_;
+#else
+    state.hash_sum = 0;
+#endif
+    savepoints_->states.push_back(state);
+
+    Savepoint savepoint;
+    savepoint.depth = savepoints_->states.size() - 1;
+    savepoint.serial = state.serial;
+#ifndef NDEBUG
+    full_hash_ = calcFullHash();
+#endif
+    return savepoint;
+  }
+
+  /*
+   * Destroys everything pushed after the savepoint in one pass. The hash sum of items
+   * is taken from the savepoint, and the buffer is shrunk at most once.
+   */
+  void rollbackTo(const Savepoint& savepoint) {
+    ASSERT_CORRECTNESS();
+    size_t depth = findSavepoint(savepoint, __PRETTY_FUNCTION__);
+    SavedState state = savepoints_->states[depth];
+
+    truncate(state.item_count);
+    savepoints_->states.resize(depth);
+    fitCapacity();
+#ifndef NDEBUG
+    ++*version_;
+    hash_sum_ = state.hash_sum;
+    full_hash_ = calcFullHash();
+#endif
+  }
+
+  /*
+   * Keeps the items and forgets the savepoint.
+   */
+  void commit(const Savepoint& savepoint) {
+    ASSERT_CORRECTNESS();
+    size_t depth = findSavepoint(savepoint, __PRETTY_FUNCTION__);
+    savepoints_->states.resize(depth);
+#ifndef NDEBUG
+    full_hash_ = calcFullHash();
+#endif
+  }
+
+#ifndef NDEBUG
+  bool check() const {
+    return findCorruption() == StackError::OK;
   }
 
-  void dump(const std::string& func_name) const {
+  void dump(const char* func_name = "") const {
     std::cerr << "__________________________________________\n";
     std::cerr << "dump was called from: " << func_name << "\n\n";
     bool correct_params = checkParams();
@@ -548,10 +1035,13 @@ class Stack {
 
   ~Stack() {
 #ifndef NDEBUG
+    // a broken stack is leaked: its pointers can't be trusted
     if (!check()) {
       return;
     }
+    ++*version_;
 #endif
+    delete savepoints_;
     destroy();
   }
 };
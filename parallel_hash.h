@@ -0,0 +1,209 @@
+#ifndef STACK_PARALLEL_HASH_H
+#define STACK_PARALLEL_HASH_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a stack with at least this number of items is hashed by WorkerPool
+#ifndef STACK_PARALLEL_HASH_THRESHOLD
+  #define STACK_PARALLEL_HASH_THRESHOLD (1 << 20)
+#endif
+
+/*
+ * (a * b) % modulo without overflow, a and b must be less than modulo.
+ */
+inline size_t mulMod(size_t a, size_t b, size_t modulo) {
+#ifdef __SIZEOF_INT128__
+  return static_cast<size_t>(static_cast<unsigned __int128>(a) * b % modulo);
+#else
+  size_t res = 0;
+  while (b > 0) {
+    if (b & 1) {
+      res = (res + a) % modulo;
+    }
+    a = (a + a) % modulo;
+    b >>= 1;
+  }
+  return res;
+#endif
+}
+
+inline size_t powMod(size_t base, size_t power, size_t modulo) {
+  size_t res = 1 % modulo;
+  base %= modulo;
+  while (power > 0) {
+    if (power & 1) {
+      res = mulMod(res, base, modulo);
+    }
+    base = mulMod(base, base, modulo);
+    power >>= 1;
+  }
+  return res;
+}
+
+/*
+ * A fixed set of threads that run the tasks of one parallelFor() at a time.
+ * The calling thread takes tasks too, so a pool without workers just runs them in place.
+ */
+class WorkerPool {
+ private:
+  std::vector<std::thread> workers_;
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable task_ready_;
+  std::condition_variable task_done_;
+  // the task is called through a plain function pointer, so parallelFor() allocates nothing
+  void (*invoke_)(const void*, size_t){nullptr};
+  const void* task_{nullptr};
+  size_t task_count_{0};
+  std::atomic<size_t> next_task_{0};
+  size_t finished_workers_{0};
+  size_t generation_{0};
+  bool stopping_{false};
+
+  template<class Task>
+  static void invokeTask(const void* task, size_t task_id) {
+    (*static_cast<const Task*>(task))(task_id);
+  }
+
+  void runTasks(void (*invoke)(const void*, size_t), const void* task, size_t task_count) {
+    for (size_t task_id = next_task_++; task_id < task_count; task_id = next_task_++) {
+      invoke(task, task_id);
+    }
+  }
+
+  void workerLoop() {
+    size_t seen_generation = 0;
+    for (;;) {
+      void (*invoke)(const void*, size_t) = nullptr;
+      const void* task = nullptr;
+      size_t task_count = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ready_.wait(lock, [&]() { return stopping_ || generation_ != seen_generation; });
+        if (stopping_) {
+          return;
+        }
+        seen_generation = generation_;
+        invoke = invoke_;
+        task = task_;
+        task_count = task_count_;
+      }
+      runTasks(invoke, task, task_count);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++finished_workers_;
+      }
+      task_done_.notify_one();
+    }
+  }
+
+ public:
+  explicit WorkerPool(size_t worker_count) {
+    for (size_t worker_id = 0; worker_id < worker_count; ++worker_id) {
+      workers_.emplace_back(&WorkerPool::workerLoop, this);
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  static WorkerPool& instance() {
+    static WorkerPool pool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+    return pool;
+  }
+
+  size_t workerCount() const {
+    return workers_.size();
+  }
+
+  /*
+   * Calls task(0), ..., task(task_count - 1) and returns when all of them are finished.
+   * The task must not throw.
+   */
+  template<class Task>
+  void parallelFor(size_t task_count, const Task& task) {
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      invoke_ = &invokeTask<Task>;
+      task_ = &task;
+      task_count_ = task_count;
+      next_task_ = 0;
+      finished_workers_ = 0;
+      ++generation_;
+    }
+    task_ready_.notify_all();
+    runTasks(invoke_, task_, task_count);
+
+    // every worker has to leave the task before it can be replaced by the next one
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_done_.wait(lock, [&]() { return finished_workers_ == workers_.size(); });
+    invoke_ = nullptr;
+    task_ = nullptr;
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    task_ready_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+};
+
+// a bound for the number of chunks, so that their hashes fit into an array on the stack
+const size_t MAX_HASH_CHUNKS = 256;
+
+/*
+ * Polynomial hash of items [0, count) that starts from seed. Item hashes are taken modulo modulo
+ * before the addition, so nothing overflows and the result can be glued from the hashes of its parts.
+ */
+template<class Item, class Hasher>
+size_t calcPolynomialHash(const Item* items, size_t count, size_t seed,
+                          const Hasher& hasher, size_t base, size_t modulo) {
+  size_t res = seed;
+  for (size_t item_id = 0; item_id < count; ++item_id) {
+    res = (res * base + hasher(items[item_id]) % modulo) % modulo;
+  }
+  return res;
+}
+
+/*
+ * The same hash computed by chunks on the pool: hash(A + B) = hash(A) * base^|B| + hash(B)
+ * for chunks hashed from zero seed. Allocates nothing.
+ */
+template<class Item, class Hasher>
+size_t calcPolynomialHashParallel(WorkerPool& pool, const Item* items, size_t count, size_t seed,
+                                  const Hasher& hasher, size_t base, size_t modulo) {
+  size_t chunk_count = std::min(4 * (pool.workerCount() + 1), MAX_HASH_CHUNKS);
+  size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+  size_t chunk_hashes[MAX_HASH_CHUNKS];
+
+  pool.parallelFor(chunk_count, [&](size_t chunk_id) {
+    size_t begin = std::min(count, chunk_id * chunk_size);
+    size_t end = std::min(count, begin + chunk_size);
+    chunk_hashes[chunk_id] = calcPolynomialHash(items + begin, end - begin, 0, hasher, base, modulo);
+  });
+
+  size_t chunk_shift = powMod(base, chunk_size, modulo);
+  size_t res = seed % modulo;
+  for (size_t chunk_id = 0; chunk_id < chunk_count; ++chunk_id) {
+    size_t begin = std::min(count, chunk_id * chunk_size);
+    size_t end = std::min(count, begin + chunk_size);
+    size_t shift = (end - begin == chunk_size ? chunk_shift : powMod(base, end - begin, modulo));
+    res = (mulMod(res, shift, modulo) + chunk_hashes[chunk_id]) % modulo;
+  }
+  return res;
+}
+
+#endif //STACK_PARALLEL_HASH_H
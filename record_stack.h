@@ -0,0 +1,338 @@
+#ifndef STACK_RECORD_STACK_H
+#define STACK_RECORD_STACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <type_traits>
+
+#include "exception.h"
+#include "memory_layout.h"
+
+#ifndef NDEBUG
+  #define ASSERT_RECORD_STACK() { assertCorrectness(__PRETTY_FUNCTION__); }
+  #define CALC_RECORD_STACK_HASH() { fields_hash_ = calcFieldsHash(); }
+#else
+  #define ASSERT_RECORD_STACK() {}
+  #define CALC_RECORD_STACK_HASH() {}
+#endif
+
+/*
+ * Stack of variable-size records in one contiguous buffer: typed values, call frames,
+ * short strings and so on. Every record is followed by a footer with its size and a user tag,
+ * so the top record is found in O(1):
+ *
+ *   [canary line][payload|padding|footer][payload|padding|footer]...[canary line]
+ *
+ * Payloads are padded to RECORD_ALIGNMENT. Without NDEBUG the buffer is guarded by canaries
+ * and by a hash of all bytes; a footer keeps the hash of everything under its record,
+ * so pop() restores the hash without recalculation. The object itself is guarded by a canary
+ * and by a hash of its fields.
+ */
+class RecordStack {
+ public:
+  static const size_t RECORD_ALIGNMENT = 8;
+
+ private:
+  static const size_t MIN_CAPACITY = 256;
+#ifndef NDEBUG
+  static const size_t CANARY_SIZE = CACHE_LINE_SIZE;
+  static const uint32_t CANARY_INIT_VALUE = 1983776228;
+  static const uint64_t MODULO = 1e12 + 7;
+  static const uint64_t BASE = 15487469;
+#else
+  static const size_t CANARY_SIZE = 0;
+#endif
+
+  struct Footer {
+#ifndef NDEBUG
+    uint64_t prefix_hash;
+#endif
+    uint32_t size;
+    uint32_t tag;
+  };
+
+#ifndef NDEBUG
+  uint32_t main_canary_{CANARY_INIT_VALUE};
+#endif
+  char* bytes_{nullptr};
+  char* data_{nullptr};
+  size_t capacity_{0};
+  size_t byte_count_{0};
+  size_t record_count_{0};
+#ifndef NDEBUG
+  char* data_copy_{nullptr};
+  uint64_t hash_sum_{0};
+  uint64_t fields_hash_{0};
+
+  uint32_t* getCanaryPtr1() const {
+    return reinterpret_cast<uint32_t*>(data_ - sizeof(uint32_t));
+  }
+
+  uint32_t* getCanaryPtr2() const {
+    return reinterpret_cast<uint32_t*>(data_ + capacity_);
+  }
+
+  uint64_t calcRangeHash(size_t begin, size_t end, uint64_t seed) const {
+    const unsigned char* cur_byte = reinterpret_cast<const unsigned char*>(data_ + begin);
+    uint64_t res = seed;
+    for (size_t byte_id = begin; byte_id < end; ++byte_id, ++cur_byte) {
+      res = (res * BASE + *cur_byte) % MODULO;
+    }
+    return res;
+  }
+
+  // field by field, so the padding between them doesn't matter
+  uint64_t calcFieldsHash() const {
+    const size_t fields[] = {reinterpret_cast<uintptr_t>(bytes_), capacity_, byte_count_, record_count_,
+                             static_cast<size_t>(hash_sum_)};
+    uint64_t res = 0;
+    for (size_t field : fields) {
+      res = (res * BASE + field % MODULO) % MODULO;
+    }
+    return res;
+  }
+
+  bool pointersIntact() const {
+    return data_copy_ == data_ && data_ == bytes_ + CANARY_SIZE && byte_count_ <= capacity_;
+  }
+
+  bool fieldsIntact() const {
+    return fields_hash_ == calcFieldsHash() && record_count_ * sizeof(Footer) <= byte_count_;
+  }
+
+  bool canariesIntact() const {
+    return main_canary_ == CANARY_INIT_VALUE
+        && *getCanaryPtr1() == CANARY_INIT_VALUE && *getCanaryPtr2() == CANARY_INIT_VALUE;
+  }
+
+  void assertCorrectness(const char* func_name = "") const {
+    if (main_canary_ != CANARY_INIT_VALUE) {
+      dump(func_name);
+      throw CanaryException("main canary was overwritten", func_name);
+    }
+    if (!fieldsIntact()) {
+      dump(func_name);
+      throw HashSumException("fields of the object were changed from outside", func_name);
+    }
+    if (!pointersIntact()) {
+      dump(func_name);
+      throw IncorrectPointerException("pointers are destroyed", func_name);
+    }
+    if (!canariesIntact()) {
+      dump(func_name);
+      throw CanaryException("canaries were overwritten", func_name);
+    }
+    if (hash_sum_ != calcRangeHash(0, byte_count_, 0)) {
+      dump(func_name);
+      throw HashSumException("hash sum of records was crashed", func_name);
+    }
+  }
+#endif
+
+  static size_t getRecordSize(size_t payload_size) {
+    return alignUp(payload_size, RECORD_ALIGNMENT) + sizeof(Footer);
+  }
+
+  Footer getTopFooter(const char* func_name) const {
+    if (record_count_ == 0) {
+      throw EmptyStackException("", func_name);
+    }
+    Footer footer;
+    std::memcpy(&footer, data_ + byte_count_ - sizeof(Footer), sizeof(Footer));
+    if (getRecordSize(footer.size) > byte_count_) {
+      throw IncorrectPointerException("footer of the top record is destroyed", func_name);
+    }
+    return footer;
+  }
+
+  // a new buffer with a copy of the records, the current one stays alive
+  char* copyToNewBuffer(size_t new_capacity) const {
+    char* new_bytes = alignedAllocate(2 * CANARY_SIZE + new_capacity, CACHE_LINE_SIZE);
+    if (new_bytes == nullptr) {
+      throw std::bad_alloc();
+    }
+    if (data_ != nullptr) {
+      std::memcpy(new_bytes + CANARY_SIZE, data_, byte_count_);
+    }
+    return new_bytes;
+  }
+
+  void setBuffer(char* new_bytes, size_t new_capacity) {
+    alignedFree(bytes_);
+    bytes_ = new_bytes;
+    data_ = bytes_ + CANARY_SIZE;
+    capacity_ = new_capacity;
+#ifndef NDEBUG
+    data_copy_ = data_;
+    *getCanaryPtr1() = CANARY_INIT_VALUE;
+    *getCanaryPtr2() = CANARY_INIT_VALUE;
+#endif
+    CALC_RECORD_STACK_HASH();
+  }
+
+ public:
+  RecordStack() {
+    setBuffer(copyToNewBuffer(MIN_CAPACITY), MIN_CAPACITY);
+  }
+
+  RecordStack(const RecordStack&) = delete;
+  RecordStack& operator=(const RecordStack&) = delete;
+
+  void pushBytes(const void* payload, size_t payload_size, uint32_t tag = 0) {
+    ASSERT_RECORD_STACK();
+    if (payload_size > UINT32_MAX) {
+      throw IncorrectArgumentException("record is too large", __PRETTY_FUNCTION__);
+    }
+    size_t record_size = getRecordSize(payload_size);
+    char* new_bytes = nullptr;
+    size_t new_capacity = capacity_;
+    if (byte_count_ + record_size > capacity_) {
+      while (byte_count_ + record_size > new_capacity) {
+        new_capacity *= 2;
+      }
+      new_bytes = copyToNewBuffer(new_capacity);
+    }
+
+    // the payload may be a record of this stack, so the old buffer is freed only after the copy
+    char* record = (new_bytes != nullptr ? new_bytes + CANARY_SIZE : data_) + byte_count_;
+    std::memcpy(record, payload, payload_size);
+    std::memset(record + payload_size, 0, record_size - sizeof(Footer) - payload_size);
+    Footer footer;
+#ifndef NDEBUG
+    footer.prefix_hash = hash_sum_;
+#endif
+    footer.size = static_cast<uint32_t>(payload_size);
+    footer.tag = tag;
+    std::memcpy(record + record_size - sizeof(Footer), &footer, sizeof(Footer));
+    if (new_bytes != nullptr) {
+      setBuffer(new_bytes, new_capacity);
+    }
+
+#ifndef NDEBUG
+    hash_sum_ = calcRangeHash(byte_count_, byte_count_ + record_size, hash_sum_);
+#endif
+    byte_count_ += record_size;
+    ++record_count_;
+    CALC_RECORD_STACK_HASH();
+  }
+
+  template<class T>
+  void push(const T& value, uint32_t tag = 0) {
+    static_assert(std::is_trivially_copyable<T>::value, "records are copied byte by byte");
+    pushBytes(&value, sizeof(T), tag);
+  }
+
+  void pushString(const std::string& str, uint32_t tag = 0) {
+    pushBytes(str.data(), str.size(), tag);
+  }
+
+  void pop() {
+    ASSERT_RECORD_STACK();
+    Footer footer = getTopFooter(__PRETTY_FUNCTION__);
+    byte_count_ -= getRecordSize(footer.size);
+    --record_count_;
+#ifndef NDEBUG
+    hash_sum_ = footer.prefix_hash;
+#endif
+    CALC_RECORD_STACK_HASH();
+  }
+
+  uint32_t topTag() const {
+    ASSERT_RECORD_STACK();
+    return getTopFooter(__PRETTY_FUNCTION__).tag;
+  }
+
+  size_t topSize() const {
+    ASSERT_RECORD_STACK();
+    return getTopFooter(__PRETTY_FUNCTION__).size;
+  }
+
+  /*
+   * Payload of the top record, aligned to RECORD_ALIGNMENT. Valid until the next push or pop.
+   */
+  const void* topData() const {
+    ASSERT_RECORD_STACK();
+    Footer footer = getTopFooter(__PRETTY_FUNCTION__);
+    return data_ + byte_count_ - getRecordSize(footer.size);
+  }
+
+  template<class T>
+  T top() const {
+    static_assert(std::is_trivially_copyable<T>::value, "records are copied byte by byte");
+    if (topSize() != sizeof(T)) {
+      throw IncorrectArgumentException("the top record has another size", __PRETTY_FUNCTION__);
+    }
+    T value;
+    std::memcpy(&value, topData(), sizeof(T));
+    return value;
+  }
+
+  std::string topString() const {
+    return std::string(static_cast<const char*>(topData()), topSize());
+  }
+
+  size_t size() const {
+    ASSERT_RECORD_STACK();
+    return record_count_;
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  /*
+   * Bytes taken by records together with their paddings and footers.
+   */
+  size_t bytes() const {
+    ASSERT_RECORD_STACK();
+    return byte_count_;
+  }
+
+#ifndef NDEBUG
+  bool check() const {
+    return main_canary_ == CANARY_INIT_VALUE && fieldsIntact() && pointersIntact() && canariesIntact()
+        && hash_sum_ == calcRangeHash(0, byte_count_, 0);
+  }
+
+  void dump(const char* func_name = "") const {
+    std::cerr << "__________________________________________\n";
+    std::cerr << "dump was called from: " << func_name << "\n\n";
+    std::cerr << "record count: " << record_count_ << ", bytes: " << byte_count_ << ", capacity: " << capacity_ << '\n';
+    std::cerr << "main canary = " << main_canary_
+              << (main_canary_ == CANARY_INIT_VALUE ? " OK\n" : " incorrect value!\n");
+    std::cerr << "hash of fields = " << fields_hash_ << (fieldsIntact() ? " OK\n" : " incorrect value!\n");
+    if (!pointersIntact()) {
+      std::cerr << "pointers were destroyed! I'm unable to print records of the stack.\n";
+      return;
+    }
+    std::cerr << "canary 1 = " << *getCanaryPtr1() << ", canary 2 = " << *getCanaryPtr2()
+              << (canariesIntact() ? " OK\n" : " incorrect value!\n");
+    uint64_t correct_hash_sum = calcRangeHash(0, byte_count_, 0);
+    std::cerr << "saved hash sum: " << hash_sum_
+              << (hash_sum_ == correct_hash_sum ? " OK\n" : " incorrect value!\n");
+
+    std::cerr << "records from the top:\n";
+    size_t end = byte_count_;
+    for (size_t record_id = 0; record_id < record_count_; ++record_id) {
+      Footer footer;
+      std::memcpy(&footer, data_ + end - sizeof(Footer), sizeof(Footer));
+      if (getRecordSize(footer.size) > end) {
+        std::cerr << "footer is destroyed\n";
+        return;
+      }
+      std::cerr << "  tag " << footer.tag << ", size " << footer.size << '\n';
+      end -= getRecordSize(footer.size);
+    }
+  }
+#endif
+
+  ~RecordStack() {
+    alignedFree(bytes_);
+  }
+};
+
+#endif //STACK_RECORD_STACK_H
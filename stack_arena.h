@@ -0,0 +1,326 @@
+#ifndef STACK_STACK_ARENA_H
+#define STACK_STACK_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "exception.h"
+#include "memory_layout.h"
+
+/*
+ * Storage for a lot of small stacks. Items of all stacks live in big shared slabs,
+ * a stack is addressed by a small Handle, and all the memory is given back at once by reset().
+ *
+ * Slab layout (the guard after a block is the guard before the next one):
+ *
+ *   [guard][header|items...][guard][header|items...][guard]...
+ *
+ * Blocks of stacks that grew up are reused by other stacks of the same capacity.
+ * Guards and hash sums exist only without NDEBUG, like in Stack.
+ */
+template<class T>
+class StackArena {
+  static_assert(std::is_trivially_copyable<T>::value, "items are moved between blocks by memcpy");
+
+ public:
+  /*
+   * Ids of released stacks are given to new ones. Without NDEBUG the generation tells
+   * a stale handle from the new owner of its id, with NDEBUG using a stale handle is undefined.
+   */
+  struct Handle {
+    uint32_t id;
+#ifndef NDEBUG
+    uint32_t generation;
+#endif
+  };
+
+ private:
+  static const size_t MIN_CAPACITY = 4;
+  static const size_t SLAB_SIZE = 1 << 16;
+  static const size_t ALIGNMENT = (alignof(T) > alignof(uint64_t) ? alignof(T) : alignof(uint64_t));
+
+  struct Header {
+    uint32_t item_count;
+    uint32_t capacity_class;
+#ifndef NDEBUG
+    uint64_t hash_sum;
+#endif
+  };
+
+  static const size_t HEADER_SIZE = alignUp(sizeof(Header), ALIGNMENT);
+#ifndef NDEBUG
+  static const uint32_t CANARY_INIT_VALUE = 1983776228;
+  static const size_t GUARD_SIZE = alignUp(sizeof(uint32_t), ALIGNMENT);
+  static const uint64_t MODULO = 1e12 + 7;
+  static const uint64_t BASE = 15487469;
+
+  std::hash<T> hasher_;
+  // generations of the current owners of ids, every create() takes a new one
+  std::vector<uint32_t> generations_;
+  uint32_t next_generation_{0};
+#else
+  static const size_t GUARD_SIZE = 0;
+#endif
+
+  std::vector<char*> slabs_;
+  char* slab_cur_{nullptr};
+  char* slab_end_{nullptr};
+  size_t allocated_bytes_{0};
+  size_t stack_count_{0};
+  std::vector<char*> blocks_;
+  std::vector<uint32_t> free_ids_;
+  std::vector<std::vector<char*>> free_blocks_;
+
+  static size_t capacityOf(size_t capacity_class) {
+    return MIN_CAPACITY << capacity_class;
+  }
+
+  static size_t blockSize(size_t capacity_class) {
+    return HEADER_SIZE + alignUp(capacityOf(capacity_class) * sizeof(T), ALIGNMENT) + GUARD_SIZE;
+  }
+
+  static Header* getHeader(char* block) {
+    return reinterpret_cast<Header*>(block);
+  }
+
+  static const Header* getHeader(const char* block) {
+    return reinterpret_cast<const Header*>(block);
+  }
+
+  static T* getItems(char* block) {
+    return reinterpret_cast<T*>(block + HEADER_SIZE);
+  }
+
+  static const T* getItems(const char* block) {
+    return reinterpret_cast<const T*>(block + HEADER_SIZE);
+  }
+
+#ifndef NDEBUG
+  static uint32_t* getGuardBefore(const char* block) {
+    return reinterpret_cast<uint32_t*>(const_cast<char*>(block) - GUARD_SIZE);
+  }
+
+  static uint32_t* getGuardAfter(const char* block) {
+    const Header* header = getHeader(block);
+    return reinterpret_cast<uint32_t*>(const_cast<char*>(block) + blockSize(header->capacity_class) - GUARD_SIZE);
+  }
+
+  uint64_t calcHashSum(const char* block) const {
+    const Header* header = getHeader(block);
+    const T* items = getItems(block);
+    uint64_t res = header->item_count;
+    for (size_t item_id = 0; item_id < header->item_count; ++item_id) {
+      res = (res * BASE + hasher_(items[item_id])) % MODULO;
+    }
+    return res;
+  }
+
+  void assertBlock(const char* block, const char* func_name) const {
+    if (*getGuardBefore(block) != CANARY_INIT_VALUE) {
+      throw CanaryException("problem with guard before the stack", func_name);
+    }
+    if (*getGuardAfter(block) != CANARY_INIT_VALUE) {
+      throw CanaryException("problem with guard after the stack", func_name);
+    }
+    if (getHeader(block)->hash_sum != calcHashSum(block)) {
+      throw HashSumException("hash sum of elements was crashed", func_name);
+    }
+  }
+#endif
+
+  void newSlab(size_t size) {
+    char* slab = alignedAllocate(size, ALIGNMENT);
+    if (slab == nullptr) {
+      throw std::bad_alloc();
+    }
+    slabs_.push_back(slab);
+    allocated_bytes_ += size;
+    slab_cur_ = slab + GUARD_SIZE;
+    slab_end_ = slab + size;
+#ifndef NDEBUG
+    *reinterpret_cast<uint32_t*>(slab) = CANARY_INIT_VALUE;
+#endif
+  }
+
+  char* allocateBlock(size_t capacity_class) {
+    char* block = nullptr;
+    if (capacity_class < free_blocks_.size() && !free_blocks_[capacity_class].empty()) {
+      block = free_blocks_[capacity_class].back();
+      free_blocks_[capacity_class].pop_back();
+    } else {
+      size_t block_size = blockSize(capacity_class);
+      if (slab_cur_ == nullptr || static_cast<size_t>(slab_end_ - slab_cur_) < block_size) {
+        newSlab(block_size + GUARD_SIZE > SLAB_SIZE ? block_size + GUARD_SIZE : SLAB_SIZE);
+      }
+      block = slab_cur_;
+      slab_cur_ += block_size;
+    }
+
+    Header* header = getHeader(block);
+    header->item_count = 0;
+    header->capacity_class = static_cast<uint32_t>(capacity_class);
+#ifndef NDEBUG
+    header->hash_sum = calcHashSum(block);
+    *getGuardAfter(block) = CANARY_INIT_VALUE;
+#endif
+    return block;
+  }
+
+  void freeBlock(char* block) {
+    size_t capacity_class = getHeader(block)->capacity_class;
+    if (free_blocks_.size() <= capacity_class) {
+      free_blocks_.resize(capacity_class + 1);
+    }
+    free_blocks_[capacity_class].push_back(block);
+  }
+
+  char* getBlock(Handle handle, const char* func_name) const {
+    if (handle.id >= blocks_.size() || blocks_[handle.id] == nullptr) {
+      throw IncorrectPointerException("invalid stack handle", func_name);
+    }
+#ifndef NDEBUG
+    if (handle.generation != generations_[handle.id]) {
+      throw IncorrectPointerException("stack handle was invalidated by release or reset", func_name);
+    }
+    assertBlock(blocks_[handle.id], func_name);
+#endif
+    return blocks_[handle.id];
+  }
+
+  void updateHash(char* block) {
+#ifndef NDEBUG
+    getHeader(block)->hash_sum = calcHashSum(block);
+#else
+    (void)block;
+#endif
+  }
+
+ public:
+  StackArena() = default;
+  StackArena(const StackArena&) = delete;
+  StackArena& operator=(const StackArena&) = delete;
+
+  Handle create() {
+    char* block = allocateBlock(0);
+    Handle handle;
+    if (free_ids_.empty()) {
+      handle.id = static_cast<uint32_t>(blocks_.size());
+      blocks_.push_back(block);
+#ifndef NDEBUG
+      generations_.push_back(0);
+#endif
+    } else {
+      handle.id = free_ids_.back();
+      free_ids_.pop_back();
+      blocks_[handle.id] = block;
+    }
+#ifndef NDEBUG
+    handle.generation = generations_[handle.id] = next_generation_++;
+#endif
+    ++stack_count_;
+    return handle;
+  }
+
+  void release(Handle handle) {
+    char* block = getBlock(handle, __PRETTY_FUNCTION__);
+    freeBlock(block);
+    blocks_[handle.id] = nullptr;
+    free_ids_.push_back(handle.id);
+    --stack_count_;
+  }
+
+  void push(Handle handle, const T& value) {
+    char* block = getBlock(handle, __PRETTY_FUNCTION__);
+    Header* header = getHeader(block);
+
+    if (header->item_count == capacityOf(header->capacity_class)) {
+      char* new_block = allocateBlock(header->capacity_class + 1);
+      std::memcpy(getItems(new_block), getItems(block), header->item_count * sizeof(T));
+      getHeader(new_block)->item_count = header->item_count;
+      freeBlock(block);
+      blocks_[handle.id] = block = new_block;
+      header = getHeader(block);
+    }
+    getItems(block)[header->item_count] = value;
+    ++header->item_count;
+    updateHash(block);
+  }
+
+  void pop(Handle handle) {
+    char* block = getBlock(handle, __PRETTY_FUNCTION__);
+    if (getHeader(block)->item_count == 0) {
+      throw EmptyStackException("", __PRETTY_FUNCTION__);
+    }
+    --getHeader(block)->item_count;
+    updateHash(block);
+  }
+
+  const T& top(Handle handle) const {
+    const char* block = getBlock(handle, __PRETTY_FUNCTION__);
+    if (getHeader(block)->item_count == 0) {
+      throw EmptyStackException("", __PRETTY_FUNCTION__);
+    }
+    return getItems(block)[getHeader(block)->item_count - 1];
+  }
+
+  const T& at(Handle handle, size_t pos) const {
+    const char* block = getBlock(handle, __PRETTY_FUNCTION__);
+    if (pos >= getHeader(block)->item_count) {
+      throw OutOfRangeException("the argument is more than the number of elements", __PRETTY_FUNCTION__);
+    }
+    return getItems(block)[pos];
+  }
+
+  size_t size(Handle handle) const {
+    return getHeader(getBlock(handle, __PRETTY_FUNCTION__))->item_count;
+  }
+
+  bool empty(Handle handle) const {
+    return size(handle) == 0;
+  }
+
+  /*
+   * Frees all slabs at once. Every handle given out before becomes invalid.
+   */
+  void reset() {
+    for (char* slab : slabs_) {
+      alignedFree(slab);
+    }
+    slabs_.clear();
+    blocks_.clear();
+    free_ids_.clear();
+    free_blocks_.clear();
+    slab_cur_ = slab_end_ = nullptr;
+    allocated_bytes_ = 0;
+    stack_count_ = 0;
+#ifndef NDEBUG
+    generations_.clear();
+#endif
+  }
+
+  size_t stackCount() const {
+    return stack_count_;
+  }
+
+  /*
+   * Bytes taken by slabs and the handle table.
+   */
+  size_t memoryUsage() const {
+    size_t table_bytes = blocks_.capacity() * sizeof(char*) + free_ids_.capacity() * sizeof(uint32_t);
+#ifndef NDEBUG
+    table_bytes += generations_.capacity() * sizeof(uint32_t);
+#endif
+    return allocated_bytes_ + table_bytes;
+  }
+
+  ~StackArena() {
+    reset();
+  }
+};
+
+#endif //STACK_STACK_ARENA_H
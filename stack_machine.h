@@ -0,0 +1,406 @@
+#ifndef STACK_STACK_MACHINE_H
+#define STACK_STACK_MACHINE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "exception.h"
+#include "my_stack.h"
+
+#if defined(__GNUC__)
+  #define STACK_MACHINE_COMPUTED_GOTO
+#endif
+
+struct BytecodeException : public StackException {
+  BytecodeException(const std::string& message, const std::string& function_name = ""):
+    StackException(message, function_name) {}
+};
+
+typedef int64_t Word;
+
+/*
+ * Bytecode is a flat byte array: one byte of opcode followed by its operands,
+ * each operand is a Word stored in native byte order.
+ * Jump and call targets are byte offsets in the code.
+ */
+enum Opcode : uint8_t {
+  OP_HALT,     // stop, the result is the top of the operand stack
+  OP_PUSH,     // PUSH value
+  OP_POP,
+  OP_DUP,
+  OP_SWAP,
+  OP_OVER,     // a b -> a b a
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_LT,
+  OP_EQ,
+  OP_NOT,
+  OP_JMP,      // JMP target
+  OP_JZ,       // JZ target, pops the condition
+  OP_JNZ,      // JNZ target, pops the condition
+  OP_CALL,     // CALL target argc, the last argc operands become arguments of the callee
+  OP_RET,      // pops the return value, drops the arguments and pushes the value back
+  OP_ARG,      // ARG index, pushes an argument of the current frame
+  OP_LOAD,     // LOAD address, pushes memory[address]
+  OP_STORE,    // STORE address, pops into memory[address]
+  OP_LOADI,    // address -> memory[address]
+  OP_STOREI,   // address value -> (memory[address] = value)
+  OPCODE_COUNT
+};
+
+const char* const OPCODE_NAMES[OPCODE_COUNT] = {
+  "HALT", "PUSH", "POP", "DUP", "SWAP", "OVER", "ADD", "SUB", "MUL", "DIV", "MOD", "LT", "EQ", "NOT",
+  "JMP", "JZ", "JNZ", "CALL", "RET", "ARG", "LOAD", "STORE", "LOADI", "STOREI"
+};
+
+const size_t OPCODE_OPERANDS[OPCODE_COUNT] = {
+  0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 2, 0, 1, 1, 1, 0, 0
+};
+
+typedef std::vector<uint8_t> Bytecode;
+
+struct Frame {
+  size_t return_address{0};
+  size_t base{0};
+  size_t argc{0};
+
+  bool operator==(const Frame& another) const {
+    return return_address == another.return_address && base == another.base && argc == another.argc;
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Frame& frame) {
+  os << "{ret " << frame.return_address << ", base " << frame.base << ", argc " << frame.argc << "}";
+  return os;
+}
+
+namespace std {
+template<>
+struct hash<Frame> {
+  size_t operator()(const Frame& frame) const {
+    return (hash<size_t>()(frame.return_address) * 31 + hash<size_t>()(frame.base)) * 31 + hash<size_t>()(frame.argc);
+  }
+};
+}
+
+/*
+ * Translates text like
+ *
+ *   loop:  LOAD 0
+ *          JZ end      ; comment
+ *
+ * into bytecode. Operands are integers or labels, HALT is appended to the end.
+ */
+inline Bytecode assemble(const std::string& source) {
+  std::map<std::string, uint8_t> opcodes;
+  for (size_t op = 0; op < OPCODE_COUNT; ++op) {
+    opcodes[OPCODE_NAMES[op]] = static_cast<uint8_t>(op);
+  }
+
+  std::map<std::string, Word> labels;
+  std::vector<std::pair<size_t, std::string>> fixups;
+  Bytecode code;
+
+  std::istringstream lines(source);
+  std::string line;
+  size_t line_id = 0;
+  while (std::getline(lines, line)) {
+    ++line_id;
+    line = line.substr(0, line.find(';'));
+    std::istringstream tokens(line);
+    std::string token;
+
+    while (tokens >> token && token.back() == ':') {
+      token.pop_back();
+      if (labels.count(token)) {
+        throw BytecodeException("label " + token + " is defined twice, line " + std::to_string(line_id));
+      }
+      labels[token] = static_cast<Word>(code.size());
+    }
+    if (!tokens) {
+      continue;
+    }
+
+    auto op = opcodes.find(token);
+    if (op == opcodes.end()) {
+      throw BytecodeException("unknown instruction " + token + ", line " + std::to_string(line_id));
+    }
+    code.push_back(op->second);
+
+    for (size_t operand_id = 0; operand_id < OPCODE_OPERANDS[op->second]; ++operand_id) {
+      if (!(tokens >> token)) {
+        throw BytecodeException("not enough operands, line " + std::to_string(line_id));
+      }
+      Word value = 0;
+      char* end = nullptr;
+      value = std::strtoll(token.c_str(), &end, 10);
+      if (*end != '\0') {
+        fixups.emplace_back(code.size(), token);
+      }
+      code.resize(code.size() + sizeof(Word));
+      std::memcpy(code.data() + code.size() - sizeof(Word), &value, sizeof(Word));
+    }
+    if (tokens >> token) {
+      throw BytecodeException("too many operands, line " + std::to_string(line_id));
+    }
+  }
+  code.push_back(OP_HALT);
+
+  for (auto& fixup : fixups) {
+    auto label = labels.find(fixup.second);
+    if (label == labels.end()) {
+      throw BytecodeException("unknown label " + fixup.second);
+    }
+    std::memcpy(code.data() + fixup.first, &label->second, sizeof(Word));
+  }
+  return code;
+}
+
+/*
+ * Interpreter of the bytecode above. Operands and call frames live in two separate Stacks,
+ * so every instruction goes through the same integrity checks as any other user of Stack.
+ */
+class StackMachine {
+ private:
+  Stack<Word> operands_;
+  Stack<Frame> frames_;
+  std::vector<Word> memory_;
+
+  Word fetchWord(const Bytecode& code, size_t& pc) const {
+    if (pc + sizeof(Word) > code.size()) {
+      throw BytecodeException("operand is out of code", __PRETTY_FUNCTION__);
+    }
+    Word value;
+    std::memcpy(&value, code.data() + pc, sizeof(Word));
+    pc += sizeof(Word);
+    return value;
+  }
+
+  size_t fetchAddress(const Bytecode& code, size_t& pc) const {
+    Word address = fetchWord(code, pc);
+    if (address < 0 || static_cast<size_t>(address) >= code.size()) {
+      throw BytecodeException("jump out of code", __PRETTY_FUNCTION__);
+    }
+    return static_cast<size_t>(address);
+  }
+
+  Word& memoryAt(Word address) {
+    if (address < 0 || static_cast<size_t>(address) >= memory_.size()) {
+      throw BytecodeException("memory access out of range", __PRETTY_FUNCTION__);
+    }
+    return memory_[address];
+  }
+
+  [[noreturn]] void throwInvalidInstruction(size_t pc) const {
+    throw BytecodeException("invalid instruction at " + std::to_string(pc), __PRETTY_FUNCTION__);
+  }
+
+  Word popOperand() {
+    Word value = operands_.top();
+    operands_.pop();
+    return value;
+  }
+
+ public:
+  explicit StackMachine(size_t memory_size = 0): memory_(memory_size, 0) {}
+
+  std::vector<Word>& memory() {
+    return memory_;
+  }
+
+  Word run(const Bytecode& code) {
+    size_t pc = 0;
+    Word lhs = 0;
+    Word rhs = 0;
+    uint8_t op = OP_HALT;
+
+#ifdef STACK_MACHINE_COMPUTED_GOTO
+    static void* const DISPATCH_TABLE[OPCODE_COUNT] = {
+      &&op_HALT, &&op_PUSH, &&op_POP, &&op_DUP, &&op_SWAP, &&op_OVER, &&op_ADD, &&op_SUB, &&op_MUL,
+      &&op_DIV, &&op_MOD, &&op_LT, &&op_EQ, &&op_NOT, &&op_JMP, &&op_JZ, &&op_JNZ, &&op_CALL, &&op_RET,
+      &&op_ARG, &&op_LOAD, &&op_STORE, &&op_LOADI, &&op_STOREI
+    };
+  // every handler ends with its own indirect jump (threaded dispatch)
+  #define VM_CASE(name) op_##name:
+  #define VM_NEXT() { \
+      if (pc >= code.size() || (op = code[pc]) >= OPCODE_COUNT) { \
+        throwInvalidInstruction(pc); \
+      } \
+      ++pc; \
+      goto *DISPATCH_TABLE[op]; \
+    }
+    VM_NEXT();
+#else
+  #define VM_CASE(name) case OP_##name:
+  #define VM_NEXT() continue
+    for (;;) {
+      if (pc >= code.size()) {
+        throwInvalidInstruction(pc);
+      }
+      op = code[pc++];
+      switch (op) {
+#endif
+    VM_CASE(HALT)
+      return operands_.size() > 0 ? operands_.top() : 0;
+    VM_CASE(PUSH)
+      operands_.push(fetchWord(code, pc));
+      VM_NEXT();
+    VM_CASE(POP)
+      operands_.pop();
+      VM_NEXT();
+    VM_CASE(DUP)
+      lhs = operands_.top();
+      operands_.push(lhs);
+      VM_NEXT();
+    VM_CASE(SWAP)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(rhs);
+      operands_.push(lhs);
+      VM_NEXT();
+    VM_CASE(OVER)
+      rhs = popOperand();
+      lhs = operands_.top();
+      operands_.push(rhs);
+      operands_.push(lhs);
+      VM_NEXT();
+    VM_CASE(ADD)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(lhs + rhs);
+      VM_NEXT();
+    VM_CASE(SUB)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(lhs - rhs);
+      VM_NEXT();
+    VM_CASE(MUL)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(lhs * rhs);
+      VM_NEXT();
+    VM_CASE(DIV)
+      rhs = popOperand();
+      lhs = popOperand();
+      if (rhs == 0) {
+        throw BytecodeException("division by zero", __PRETTY_FUNCTION__);
+      }
+      operands_.push(lhs / rhs);
+      VM_NEXT();
+    VM_CASE(MOD)
+      rhs = popOperand();
+      lhs = popOperand();
+      if (rhs == 0) {
+        throw BytecodeException("division by zero", __PRETTY_FUNCTION__);
+      }
+      operands_.push(lhs % rhs);
+      VM_NEXT();
+    VM_CASE(LT)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(lhs < rhs);
+      VM_NEXT();
+    VM_CASE(EQ)
+      rhs = popOperand();
+      lhs = popOperand();
+      operands_.push(lhs == rhs);
+      VM_NEXT();
+    VM_CASE(NOT)
+      lhs = popOperand();
+      operands_.push(!lhs);
+      VM_NEXT();
+    VM_CASE(JMP)
+      pc = fetchAddress(code, pc);
+      VM_NEXT();
+    VM_CASE(JZ)
+      rhs = fetchAddress(code, pc);
+      if (popOperand() == 0) {
+        pc = rhs;
+      }
+      VM_NEXT();
+    VM_CASE(JNZ)
+      rhs = fetchAddress(code, pc);
+      if (popOperand() != 0) {
+        pc = rhs;
+      }
+      VM_NEXT();
+    VM_CASE(CALL) {
+      Frame frame;
+      rhs = fetchAddress(code, pc);
+      lhs = fetchWord(code, pc);
+      if (lhs < 0 || static_cast<size_t>(lhs) > operands_.size()) {
+        throw BytecodeException("not enough arguments for a call", __PRETTY_FUNCTION__);
+      }
+      frame.return_address = pc;
+      frame.base = operands_.size() - lhs;
+      frame.argc = lhs;
+      frames_.push(frame);
+      pc = rhs;
+      VM_NEXT();
+    }
+    VM_CASE(RET) {
+      if (frames_.size() == 0) {
+        throw BytecodeException("return without a call", __PRETTY_FUNCTION__);
+      }
+      Frame frame = frames_.top();
+      frames_.pop();
+      lhs = popOperand();
+      while (operands_.size() > frame.base) {
+        operands_.pop();
+      }
+      operands_.push(lhs);
+      pc = frame.return_address;
+      VM_NEXT();
+    }
+    VM_CASE(ARG) {
+      lhs = fetchWord(code, pc);
+      if (frames_.size() == 0) {
+        throw BytecodeException("argument outside of a call", __PRETTY_FUNCTION__);
+      }
+      const Frame& frame = frames_.top();
+      if (lhs < 0 || static_cast<size_t>(lhs) >= frame.argc) {
+        throw BytecodeException("argument index is out of range", __PRETTY_FUNCTION__);
+      }
+      // push() may move the buffer, so the argument is copied out of it first
+      rhs = operands_[frame.base + lhs];
+      operands_.push(rhs);
+      VM_NEXT();
+    }
+    VM_CASE(LOAD)
+      operands_.push(memoryAt(fetchWord(code, pc)));
+      VM_NEXT();
+    VM_CASE(STORE)
+      lhs = fetchWord(code, pc);
+      memoryAt(lhs) = popOperand();
+      VM_NEXT();
+    VM_CASE(LOADI)
+      lhs = popOperand();
+      operands_.push(memoryAt(lhs));
+      VM_NEXT();
+    VM_CASE(STOREI)
+      rhs = popOperand();
+      lhs = popOperand();
+      memoryAt(lhs) = rhs;
+      VM_NEXT();
+#ifndef STACK_MACHINE_COMPUTED_GOTO
+        default:
+          throwInvalidInstruction(pc - 1);
+      }
+    }
+#endif
+  #undef VM_CASE
+  #undef VM_NEXT
+  }
+};
+
+#endif //STACK_STACK_MACHINE_H
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "stack_machine.h"
+
+/*
+ * Runs the same bytecode programs on top of Stack. Build it with and without NDEBUG
+ * (vm_benchmark and vm_benchmark_unchecked targets) to see the cost of the integrity checks.
+ * The checked build reports reallocations to stderr, so redirect it: ./vm_benchmark 2>/dev/null
+ */
+
+std::string fibProgram(int n) {
+  return
+    "        PUSH " + std::to_string(n) + "\n"
+    "        CALL fib 1\n"
+    "        HALT\n"
+    "fib:    ARG 0\n"
+    "        PUSH 2\n"
+    "        LT\n"
+    "        JZ recurse\n"
+    "        ARG 0\n"
+    "        RET\n"
+    "recurse:\n"
+    "        ARG 0\n"
+    "        PUSH 1\n"
+    "        SUB\n"
+    "        CALL fib 1\n"
+    "        ARG 0\n"
+    "        PUSH 2\n"
+    "        SUB\n"
+    "        CALL fib 1\n"
+    "        ADD\n"
+    "        RET\n";
+}
+
+// sum of i * i for i in [0, n), memory[0] = i, memory[1] = sum
+std::string loopProgram(int n) {
+  return
+    "        PUSH 0\n"
+    "        STORE 0\n"
+    "        PUSH 0\n"
+    "        STORE 1\n"
+    "loop:   LOAD 0\n"
+    "        PUSH " + std::to_string(n) + "\n"
+    "        LT\n"
+    "        JZ end\n"
+    "        LOAD 1\n"
+    "        LOAD 0\n"
+    "        DUP\n"
+    "        MUL\n"
+    "        ADD\n"
+    "        STORE 1\n"
+    "        LOAD 0\n"
+    "        PUSH 1\n"
+    "        ADD\n"
+    "        STORE 0\n"
+    "        JMP loop\n"
+    "end:    LOAD 1\n";
+}
+
+// insertion sort of memory[2 .. n + 2), memory[0] = i, memory[1] = j
+std::string sortProgram(int n) {
+  return
+    "        PUSH 1\n"
+    "        STORE 0\n"
+    "outer:  LOAD 0\n"
+    "        PUSH " + std::to_string(n) + "\n"
+    "        LT\n"
+    "        JZ done\n"
+    "        LOAD 0\n"
+    "        STORE 1\n"
+    "inner:  LOAD 1\n"
+    "        JZ next\n"
+    "        LOAD 1      ; a[j]\n"
+    "        PUSH 2\n"
+    "        ADD\n"
+    "        LOADI\n"
+    "        LOAD 1      ; a[j - 1]\n"
+    "        PUSH 1\n"
+    "        ADD\n"
+    "        LOADI\n"
+    "        LT\n"
+    "        JZ next\n"
+    "        LOAD 1      ; &a[j - 1]\n"
+    "        PUSH 1\n"
+    "        ADD\n"
+    "        LOAD 1      ; a[j]\n"
+    "        PUSH 2\n"
+    "        ADD\n"
+    "        LOADI\n"
+    "        LOAD 1      ; &a[j]\n"
+    "        PUSH 2\n"
+    "        ADD\n"
+    "        LOAD 1      ; a[j - 1]\n"
+    "        PUSH 1\n"
+    "        ADD\n"
+    "        LOADI\n"
+    "        STOREI\n"
+    "        STOREI\n"
+    "        LOAD 1\n"
+    "        PUSH 1\n"
+    "        SUB\n"
+    "        STORE 1\n"
+    "        JMP inner\n"
+    "next:   LOAD 0\n"
+    "        PUSH 1\n"
+    "        ADD\n"
+    "        STORE 0\n"
+    "        JMP outer\n"
+    "done:   PUSH 0\n";
+}
+
+Word fib(int n) {
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+template<class Function>
+void measure(const std::string& name, Function function) {
+  auto start = std::chrono::steady_clock::now();
+  bool ok = function();
+  auto finish = std::chrono::steady_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(finish - start).count();
+#ifdef NDEBUG
+  const char* mode = "unchecked";
+#else
+  const char* mode = "checked";
+#endif
+  std::printf("%-10s %-12s %10.2f ms %s\n", mode, name.c_str(), ms, ok ? "OK" : "WRONG RESULT");
+}
+
+int main(int argc, char** argv) {
+  int scale = (argc > 1 ? std::stoi(argv[1]) : 1);
+  const int fib_n = 16 + scale;
+  const int loop_n = 10000 * scale;
+  const int sort_n = 200 * scale;
+
+  try {
+    Bytecode fib_code = assemble(fibProgram(fib_n));
+    Bytecode loop_code = assemble(loopProgram(loop_n));
+    Bytecode sort_code = assemble(sortProgram(sort_n));
+
+    measure("fib(" + std::to_string(fib_n) + ")", [&]() {
+      StackMachine machine;
+      return machine.run(fib_code) == fib(fib_n);
+    });
+
+    measure("loop(" + std::to_string(loop_n) + ")", [&]() {
+      StackMachine machine(2);
+      Word expected = 0;
+      for (Word i = 0; i < loop_n; ++i) {
+        expected += i * i;
+      }
+      return machine.run(loop_code) == expected;
+    });
+
+    measure("sort(" + std::to_string(sort_n) + ")", [&]() {
+      StackMachine machine(sort_n + 2);
+      uint32_t seed = 228;
+      for (int i = 0; i < sort_n; ++i) {
+        seed = seed * 1103515245 + 12345;
+        machine.memory()[i + 2] = seed % 1000;
+      }
+      machine.run(sort_code);
+      return std::is_sorted(machine.memory().begin() + 2, machine.memory().end());
+    });
+  } catch (StackException& exc) {
+    std::cerr << exc;
+    return 1;
+  }
+  return 0;
+}